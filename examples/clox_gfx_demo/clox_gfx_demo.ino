@@ -1,6 +1,7 @@
 extern "C" {
 #include "vm.h"
 #include "memory.h"
+#include "heap.h"
 #include "clox_stdio.h"
 #include "clox_gfx.h"
 }
@@ -8,6 +9,9 @@ extern "C" {
 #include "clox_gfx_config.h"
 #if CLOX_USE_SDRAM
 #include <SDRAM.h>
+#ifndef CLOX_SDRAM_HEAP_SIZE
+#define CLOX_SDRAM_HEAP_SIZE (4 * 1024 * 1024)
+#endif
 #endif
 
 #if CLOX_GRAPHICS
@@ -104,8 +108,24 @@ void setup() {
   delay(1000);
 #if CLOX_USE_SDRAM && NEED_SDRAM_BEGIN
   SDRAM.begin();
+#endif
+#if CLOX_USE_SDRAM
+  void* sdram = SDRAM.malloc(CLOX_SDRAM_HEAP_SIZE);
+  if (sdram == NULL) {
+    Serial_printf("Fatal Error: Could not reserve SDRAM heap.");
+    exit(1);
+  }
+  initHeap(sdram, CLOX_SDRAM_HEAP_SIZE);
 #endif
   initVM();
+#if CLOX_USE_SDRAM
+  // With SDRAM the heap can grow to a quarter of it before the first
+  // major collection, rather than the default suited to internal RAM.
+  setGcThresholds(GC_NURSERY_SIZE, CLOX_SDRAM_HEAP_SIZE / 4,
+                  GC_HEAP_GROW_FACTOR);
+  // Leave room for the allocator's own overhead and fragmentation.
+  vm.heapLimit = CLOX_SDRAM_HEAP_SIZE / 8 * 7;
+#endif
 #if CLOX_USB_HOST
   Serial_printf("Waiting for USB device...\n");
   long until = millis() + 15 * 1000L;
@@ -123,7 +143,7 @@ void loop() {
 #if CLOX_WEB_CONSOLE
   String console_buffer;
 #endif
-  while (line != "\n" && !line.startsWith("load")) {
+  while (line != "\n" && !isCommand(line)) {
     line = "";
     char ch = '\0';
     while (ch != '\n') {
@@ -157,25 +177,29 @@ void loop() {
     if (Serial) {
       Serial.print(line.c_str()); // note: do not echo to Web Terminal
     }
-    if (line != "\n" && !line.startsWith("load")) {
+    if (line != "\n" && !isCommand(line)) {
       Serial_printf(". ");
     }
   }
 
   digitalWrite(LEDB, LOW);
-  if (line.startsWith("load")) {
+  if (line.startsWith("heap")) {
+#if CLOX_USE_SDRAM
+    printHeapInfo();
+#else
+    Serial_printf("Error: SDRAM heap not in use.\n");
+#endif
+  }
+  else if (line.startsWith("load") || line.startsWith("dump")) {
     String filename;
     if (line.indexOf('\"') != line.lastIndexOf('\"')) {
       filename = line.substring(line.indexOf('\"') + 1, line.lastIndexOf('\"'));
     }
     if (filename.length()) {
-      String program = readFile(filename);
-      if (program.length()) {
-        interpret(program.c_str());
-      }
+      runFile(filename, line.startsWith("dump"));
     }
     else {
-      Serial_printf("%s\n", "Syntax: load \"my_script.lox\"");
+      Serial_printf("%s\n", "Syntax: load \"my_script.lox\" or dump \"my_script.lox\"");
     }
   }
   else {
@@ -184,8 +208,33 @@ void loop() {
   digitalWrite(LEDB, HIGH);
 }
 
-String readFile(String filename) {
-  String fileData;
+bool isCommand(const String& line) {
+  return line.startsWith("load") || line.startsWith("dump") || line.startsWith("heap");
+}
+
+String imageName(String filename) {
+  // C identifier for the array printed by compileImage(), "gfx.lox" becomes "gfx_lox"
+  String name = filename;
+  for (unsigned i = 0; i != name.length(); ++i) {
+    if (!isAlphaNumeric(name.charAt(i))) {
+      name.setCharAt(i, '_');
+    }
+  }
+  if (isDigit(name.charAt(0))) {
+    name = String("_") + name;
+  }
+  return name;
+}
+
+#if CLOX_USB_HOST
+int readSource(void* context, char* buffer, int size) {
+  return (int)fread(buffer, 1, size, (FILE*)context);
+}
+#endif
+
+// Scripts are compiled as they are read, so they don't have to fit in
+// memory alongside their bytecode.
+void runFile(String filename, bool dump) {
 #if CLOX_USB_HOST
   Serial_printf("Mounting USB device...\n");
   mbed::FATFileSystem usb("usb");
@@ -194,17 +243,19 @@ String readFile(String filename) {
     Serial_printf("Error mounting USB device: %d\n", err);
   }
   else {
-    filename = String("/usb/") + filename;
-    FILE *f = fopen(filename.c_str(), "r+");
+    String path = String("/usb/") + filename;
+    FILE *f = fopen(path.c_str(), "r");
     if (f) {
-      char buf[256];
-      while (fgets(buf, 256, f) != NULL) {
-        fileData += String(buf);
+      if (dump) {
+        compileImageStream(readSource, f, imageName(filename).c_str());
+      }
+      else {
+        interpretStream(readSource, f);
       }
       fclose(f);
     }
     else {
-      Serial_printf("Error reading file: %s\n", filename.c_str());
+      Serial_printf("Error reading file: %s\n", path.c_str());
     }
     if (!usb.unmount()) {
       Serial_printf("USB device dismounted.\n");
@@ -213,7 +264,6 @@ String readFile(String filename) {
 #else
   Serial_printf("Error: USB support not available.\n");
 #endif
-  return fileData;
 }
 
 #if CLOX_WEB_CONSOLE
@@ -265,20 +315,20 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
     if (vm.bytesAllocated > vm.nextGC) {
       collectGarbage();
     }
+    checkHeapLimit(oldSize, newSize);
   }
 
   if (newSize == 0) {
-    SDRAM.free(pointer);
+    heapFree(pointer);
     return NULL;
   }
 
-  void* result = SDRAM.malloc(newSize);
+  void* result = heapReallocate(pointer, newSize);
   if (result == NULL) {
-    Serial_printf("Fatal Error: Out of memory.");
-    exit(1);
+    reclaimMemory();
+    result = heapReallocate(pointer, newSize);
+    if (result == NULL) outOfMemory(oldSize, newSize);
   }
-  memcpy(result, pointer, (oldSize < newSize) ? oldSize : newSize);
-  SDRAM.free(pointer);
   return result;
 }
 #else
@@ -289,6 +339,7 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
     if (vm.bytesAllocated > vm.nextGC) {
       collectGarbage();
     }
+    checkHeapLimit(oldSize, newSize);
   }
 
   if (newSize == 0) {
@@ -298,8 +349,9 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
 
   void* result = realloc(pointer, newSize);
   if (result == NULL) {
-    Serial_printf("Fatal Error: Out of memory.");
-    exit(1);
+    reclaimMemory();
+    result = realloc(pointer, newSize);
+    if (result == NULL) outOfMemory(oldSize, newSize);
   }
   return result;
 }
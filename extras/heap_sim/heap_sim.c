@@ -0,0 +1,98 @@
+// Host-side simulation of the SDRAM heap used by the sketch when
+// CLOX_USE_SDRAM is set. An 8MB block of host memory stands in for
+// SDRAM, and a synthetic workload shaped like the VM's (many small
+// objects, arrays that double as they grow, most objects dying young)
+// is run against it twice: once growing blocks with heapReallocate(),
+// and once the way the sketch used to, allocating, copying and freeing
+// on every resize.
+//
+// Build and run from this directory with:
+//   cc -O2 -I../../src heap_sim.c ../../src/heap.c -o heap_sim
+//   ./heap_sim [operations]
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "heap.h"
+
+#define REGION_SIZE (8 * 1024 * 1024)
+#define SLOTS 4096
+
+int Serial_printf(const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  int count = vprintf(fmt, args);
+  va_end(args);
+  return count;
+}
+
+typedef struct {
+  void* pointer;
+  size_t size;
+  bool isArray;
+} Slot;
+
+static Slot slots[SLOTS];
+static uint32_t seed = 12345;
+
+static uint32_t randomNumber() {
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed;
+}
+static void* resize(void* pointer, size_t oldSize, size_t newSize,
+                    bool inPlace) {
+  if (inPlace) return heapReallocate(pointer, newSize);
+
+  void* result = heapAllocate(newSize);
+  if (result != NULL && pointer != NULL) {
+    memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+  }
+  heapFree(pointer);
+  return result;
+}
+static void run(const char* name, long operations, bool inPlace) {
+  static uint8_t region[REGION_SIZE];
+  initHeap(region, REGION_SIZE);
+  memset(slots, 0, sizeof(slots));
+  seed = 12345;
+  size_t copied = 0;
+
+  clock_t start = clock();
+  for (long i = 0; i < operations; i++) {
+    Slot* slot = &slots[randomNumber() % SLOTS];
+    uint32_t choice = randomNumber() % 100;
+
+    if (slot->pointer == NULL) {
+      // Strings and other objects are small, arrays start at the
+      // capacity of eight elements that GROW_CAPACITY() gives them.
+      slot->isArray = choice < 20;
+      slot->size = slot->isArray ? 8 * 8 : 16 + randomNumber() % 96;
+      slot->pointer = heapAllocate(slot->size);
+    } else if (slot->isArray && choice < 60 && slot->size < 64 * 1024) {
+      if (!inPlace) copied += slot->size;
+      slot->pointer = resize(slot->pointer, slot->size, slot->size * 2,
+                             inPlace);
+      slot->size *= 2;
+    } else {
+      heapFree(slot->pointer);
+      slot->pointer = NULL;
+    }
+  }
+  double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+  printf("== %s\n", name);
+  printHeapInfo();
+  if (!inPlace) printf("bytes copied by caller %lu\n", (unsigned long)copied);
+  printf("%.1f ms\n\n", seconds * 1000);
+}
+int main(int argc, const char* argv[]) {
+  long operations = argc > 1 ? atol(argv[1]) : 1000000;
+  run("malloc, copy and free on every resize", operations, false);
+  run("heapReallocate() growing in place", operations, true);
+  return 0;
+}
@@ -0,0 +1,443 @@
+// Host-side analysis of the heap snapshots printed by heapSnapshot().
+// Copy the output from the Serial Monitor or web console into a file
+// (anything around the snapshot is skipped) and run this on it to see
+// what a script is keeping alive: the objects of each type, and the
+// objects retaining the most memory, with the path from a root to
+// each. An object's retained size is what would be freed if it were
+// no longer referenced, that is its own size plus the sizes of every
+// object only reachable through it (the objects it dominates).
+//
+// Build and run from this directory with:
+//   cc -O2 heap_snapshot.c -o heap_snapshot
+//   ./heap_snapshot snapshot.txt [count]
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_COUNT 20
+#define PATH_MAX_DEPTH 8
+
+typedef struct {
+  unsigned long long target;
+  char* name;
+  int to;
+} Edge;
+
+typedef struct {
+  unsigned long long id;
+  char* type;
+  unsigned long size;
+  char* label;
+  int firstEdge;
+  int edgeCount;
+
+  int postorder;
+  int idom;
+  int parent;
+  int parentEdge;
+  unsigned long retained;
+} Node;
+
+static Node* nodes;
+static int nodeCount = 0;
+static int nodeCapacity = 0;
+static Edge* edges;
+static int edgeCount = 0;
+static int edgeCapacity = 0;
+
+static const char* input;
+
+static void* growArray(void* array, int* capacity, size_t size) {
+  *capacity = *capacity < 64 ? 64 : *capacity * 2;
+  array = realloc(array, size * *capacity);
+  if (array == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(1);
+  }
+  return array;
+}
+static Node* addNode() {
+  if (nodeCount == nodeCapacity) {
+    nodes = growArray(nodes, &nodeCapacity, sizeof(Node));
+  }
+  Node* node = &nodes[nodeCount++];
+  memset(node, 0, sizeof(Node));
+  node->firstEdge = edgeCount;
+  return node;
+}
+static void addEdge(unsigned long long target, char* name) {
+  if (edgeCount == edgeCapacity) {
+    edges = growArray(edges, &edgeCapacity, sizeof(Edge));
+  }
+  edges[edgeCount].target = target;
+  edges[edgeCount].name = name;
+  edges[edgeCount].to = -1;
+  edgeCount++;
+}
+
+static void fail(const char* message) {
+  fprintf(stderr, "Bad snapshot: %s near \"%.20s\".\n", message, input);
+  exit(1);
+}
+static void skipWhitespace() {
+  while (*input == ' ' || *input == '\r' || *input == '\n' ||
+         *input == '\t') {
+    input++;
+  }
+}
+static bool match(char c) {
+  skipWhitespace();
+  if (*input != c) return false;
+  input++;
+  return true;
+}
+static void expect(char c) {
+  char message[] = "expected 'x'";
+  message[10] = c;
+  if (!match(c)) fail(message);
+}
+static unsigned long long parseNumber() {
+  skipWhitespace();
+  char* end;
+  unsigned long long value = strtoull(input, &end, 10);
+  if (end == input) fail("expected a number");
+  input = end;
+  return value;
+}
+static char* parseString() {
+  expect('"');
+  const char* start = input;
+  while (*input != '"') {
+    if (*input == '\0') fail("unterminated string");
+    if (*input == '\\') input++;
+    input++;
+  }
+
+  char* string = malloc(input - start + 1);
+  char* out = string;
+  for (const char* c = start; c < input; c++) {
+    if (*c != '\\') {
+      *out++ = *c;
+    } else if (c[1] == 'u') {
+      *out++ = '?';
+      c += 5;
+    } else {
+      *out++ = *++c;
+    }
+  }
+  *out = '\0';
+  input++;
+  return string;
+}
+
+// Node 0 stands for the roots, with an edge to each object they hold.
+static void parseSnapshot() {
+  const char* start = strstr(input, "{\"heapSnapshot\"");
+  if (start == NULL) fail("no heapSnapshot found");
+  input = strstr(start, "\"roots\"");
+  if (input == NULL) fail("no roots found");
+  input += strlen("\"roots\"");
+  expect(':');
+  expect('[');
+
+  Node* root = addNode();
+  root->type = "root";
+  root->label = "";
+  while (match('[')) {
+    unsigned long long target = parseNumber();
+    expect(',');
+    addEdge(target, parseString());
+    expect(']');
+    match(',');
+  }
+  root->edgeCount = edgeCount;
+  expect(']');
+  expect(',');
+
+  if (strncmp(input, "\"objects\"", 9) != 0) fail("expected objects");
+  input += 9;
+  expect(':');
+  expect('[');
+  while (match('[')) {
+    Node* node = addNode();
+    node->id = parseNumber();
+    expect(',');
+    node->type = parseString();
+    expect(',');
+    node->size = (unsigned long)parseNumber();
+    expect(',');
+    node->label = parseString();
+    expect(',');
+    expect('[');
+    while (!match(']')) {
+      unsigned long long target = parseNumber();
+      expect(',');
+      addEdge(target, parseString());
+      match(',');
+    }
+    node->edgeCount = edgeCount - node->firstEdge;
+    expect(']');
+    match(',');
+  }
+  expect(']');
+}
+
+static int compareIds(const void* a, const void* b) {
+  unsigned long long left = ((const Node*)a)->id;
+  unsigned long long right = ((const Node*)b)->id;
+  return left < right ? -1 : left > right;
+}
+static int findNode(unsigned long long id) {
+  int low = 1;
+  int high = nodeCount - 1;
+  while (low <= high) {
+    int middle = (low + high) / 2;
+    if (nodes[middle].id == id) return middle;
+    if (nodes[middle].id < id) {
+      low = middle + 1;
+    } else {
+      high = middle - 1;
+    }
+  }
+  return -1;
+}
+static void resolveEdges() {
+  qsort(nodes + 1, nodeCount - 1, sizeof(Node), compareIds);
+  for (int i = 0; i < edgeCount; i++) {
+    edges[i].to = findNode(edges[i].target);
+  }
+}
+
+// Numbers the nodes reachable from the roots in depth-first postorder,
+// remembering the edge each was first reached by for printing paths.
+// Unreachable nodes are left with a postorder of -1.
+static int* order;
+
+static void numberNodes() {
+  int* stack = malloc(sizeof(int) * nodeCount);
+  int* nextEdge = calloc(nodeCount, sizeof(int));
+  order = malloc(sizeof(int) * nodeCount);
+  for (int i = 0; i < nodeCount; i++) nodes[i].postorder = -1;
+
+  int count = 0;
+  int depth = 0;
+  bool* isVisited = calloc(nodeCount, sizeof(bool));
+  stack[depth++] = 0;
+  isVisited[0] = true;
+  nodes[0].parent = -1;
+  while (depth > 0) {
+    int current = stack[depth - 1];
+    Node* node = &nodes[current];
+    if (nextEdge[current] < node->edgeCount) {
+      int edge = node->firstEdge + nextEdge[current]++;
+      int to = edges[edge].to;
+      if (to >= 0 && !isVisited[to]) {
+        isVisited[to] = true;
+        nodes[to].parent = current;
+        nodes[to].parentEdge = edge;
+        stack[depth++] = to;
+      }
+    } else {
+      node->postorder = count;
+      order[count++] = current;
+      depth--;
+    }
+  }
+
+  free(stack);
+  free(nextEdge);
+  free(isVisited);
+}
+static int reachableCount() {
+  int count = 0;
+  for (int i = 0; i < nodeCount; i++) {
+    if (nodes[i].postorder >= 0) count++;
+  }
+  return count;
+}
+
+// The iterative algorithm from "A Simple, Fast Dominance Algorithm" by
+// Cooper, Harvey and Kennedy, over the predecessors of each node.
+static int intersect(int left, int right) {
+  while (left != right) {
+    while (nodes[left].postorder < nodes[right].postorder) {
+      left = nodes[left].idom;
+    }
+    while (nodes[right].postorder < nodes[left].postorder) {
+      right = nodes[right].idom;
+    }
+  }
+  return left;
+}
+static void findDominators() {
+  int reachable = reachableCount();
+
+  int* firstPredecessor = calloc(nodeCount + 1, sizeof(int));
+  int* predecessors = malloc(sizeof(int) * (edgeCount + 1));
+  for (int i = 0; i < nodeCount; i++) {
+    for (int j = 0; j < nodes[i].edgeCount; j++) {
+      int to = edges[nodes[i].firstEdge + j].to;
+      if (to >= 0) firstPredecessor[to + 1]++;
+    }
+  }
+  for (int i = 0; i < nodeCount; i++) {
+    firstPredecessor[i + 1] += firstPredecessor[i];
+  }
+  int* filled = calloc(nodeCount, sizeof(int));
+  for (int i = 0; i < nodeCount; i++) {
+    for (int j = 0; j < nodes[i].edgeCount; j++) {
+      int to = edges[nodes[i].firstEdge + j].to;
+      if (to < 0) continue;
+      predecessors[firstPredecessor[to] + filled[to]++] = i;
+    }
+  }
+
+  for (int i = 0; i < nodeCount; i++) nodes[i].idom = -1;
+  nodes[0].idom = 0;
+
+  bool isChanged = true;
+  while (isChanged) {
+    isChanged = false;
+    for (int i = reachable - 2; i >= 0; i--) {
+      int current = order[i];
+      int idom = -1;
+      for (int j = firstPredecessor[current];
+           j < firstPredecessor[current + 1]; j++) {
+        int predecessor = predecessors[j];
+        if (nodes[predecessor].idom < 0) continue;
+        idom = idom < 0 ? predecessor : intersect(predecessor, idom);
+      }
+      if (nodes[current].idom != idom) {
+        nodes[current].idom = idom;
+        isChanged = true;
+      }
+    }
+  }
+
+  free(firstPredecessor);
+  free(predecessors);
+  free(filled);
+}
+static void computeRetainedSizes() {
+  int reachable = reachableCount();
+  for (int i = 0; i < nodeCount; i++) nodes[i].retained = nodes[i].size;
+
+  // A node comes after everything it dominates in postorder.
+  for (int i = 0; i < reachable - 1; i++) {
+    Node* node = &nodes[order[i]];
+    nodes[node->idom].retained += node->retained;
+  }
+}
+
+static void printPath(int index) {
+  int path[PATH_MAX_DEPTH];
+  int depth = 0;
+  bool isTruncated = false;
+  for (int current = index; current > 0; current = nodes[current].parent) {
+    if (depth == PATH_MAX_DEPTH) {
+      isTruncated = true;
+      break;
+    }
+    path[depth++] = nodes[current].parentEdge;
+  }
+
+  printf("  ");
+  if (isTruncated) printf("... ");
+  for (int i = depth - 1; i >= 0; i--) {
+    printf(i == depth - 1 ? "%s" : " -> %s", edges[path[i]].name);
+  }
+  printf("\n");
+}
+static void printTypes() {
+  printf("%-12s %8s %10s\n", "type", "count", "bytes");
+  for (int i = 1; i < nodeCount; i++) {
+    if (nodes[i].type == NULL) continue;
+
+    const char* type = nodes[i].type;
+    int count = 0;
+    unsigned long bytes = 0;
+    for (int j = i; j < nodeCount; j++) {
+      if (nodes[j].type == NULL || strcmp(nodes[j].type, type) != 0) {
+        continue;
+      }
+      count++;
+      bytes += nodes[j].size;
+      if (j != i) nodes[j].type = NULL;
+    }
+    printf("%-12s %8d %10lu\n", type, count, bytes);
+  }
+}
+static int compareRetained(const void* a, const void* b) {
+  unsigned long left = nodes[*(const int*)a].retained;
+  unsigned long right = nodes[*(const int*)b].retained;
+  return left < right ? 1 : left > right ? -1 : 0;
+}
+static void printLargest(int count) {
+  int reachable = reachableCount();
+  int* largest = malloc(sizeof(int) * reachable);
+  int found = 0;
+  for (int i = 1; i < nodeCount; i++) {
+    if (nodes[i].postorder >= 0) largest[found++] = i;
+  }
+  qsort(largest, found, sizeof(int), compareRetained);
+
+  printf("\n%10s %8s  %-12s %s\n", "retained", "size", "type", "label");
+  for (int i = 0; i < found && i < count; i++) {
+    Node* node = &nodes[largest[i]];
+    printf("%10lu %8lu  %-12s %s\n", node->retained, node->size,
+           node->type, node->label);
+    printPath(largest[i]);
+  }
+  free(largest);
+}
+
+static char* readFile(const char* path) {
+  FILE* file = path == NULL ? stdin : fopen(path, "rb");
+  if (file == NULL) {
+    fprintf(stderr, "Could not open file \"%s\".\n", path);
+    exit(1);
+  }
+
+  size_t capacity = 4096;
+  size_t length = 0;
+  char* buffer = malloc(capacity);
+  size_t bytesRead;
+  while ((bytesRead = fread(buffer + length, 1, capacity - length - 1,
+                            file)) > 0) {
+    length += bytesRead;
+    if (length + 1 == capacity) {
+      capacity *= 2;
+      buffer = realloc(buffer, capacity);
+    }
+  }
+  buffer[length] = '\0';
+  if (file != stdin) fclose(file);
+  return buffer;
+}
+
+int main(int argc, const char* argv[]) {
+  if (argc > 3) {
+    fprintf(stderr, "Usage: heap_snapshot [snapshot] [count]\n");
+    exit(64);
+  }
+  input = readFile(argc > 1 ? argv[1] : NULL);
+  int count = argc > 2 ? atoi(argv[2]) : DEFAULT_COUNT;
+
+  parseSnapshot();
+  resolveEdges();
+  numberNodes();
+  findDominators();
+  computeRetainedSizes();
+
+  unsigned long total = 0;
+  for (int i = 1; i < nodeCount; i++) total += nodes[i].size;
+  printf("%d objects, %lu bytes, %d not reachable from the roots\n",
+         nodeCount - 1, total, nodeCount - reachableCount());
+
+  printLargest(count);
+  printf("\n");
+  printTypes();
+  return 0;
+}
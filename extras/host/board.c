@@ -0,0 +1,110 @@
+// The functions the sketch provides to the interpreter, for the host
+// tools in extras/ that link it. Output that the sketch would send to
+// the Serial Monitor goes to stdout, and the board functions do
+// nothing (the display is reported as 800x480 and the clocks come from
+// the host).
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "clox_gfx.h"
+#include "memory.h"
+#include "vm.h"
+
+int Serial_vfprintf(FILE* dummy, const char* fmt, va_list args) {
+  return vfprintf(stdout, fmt, args);
+}
+
+int Serial_printf(const char* fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  int nchars = Serial_vfprintf(stdout, fmt, args);
+  va_end(args);
+  return nchars;
+}
+
+int Serial_fprintf(FILE* dummy, const char* fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  int nchars = Serial_vfprintf(dummy, fmt, args);
+  va_end(args);
+  return nchars;
+}
+
+void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+  vm.bytesAllocated += newSize - oldSize;
+
+  if (newSize > oldSize) {
+    if (vm.bytesAllocated > vm.nextGC) {
+      collectGarbage();
+    }
+    checkHeapLimit(oldSize, newSize);
+  }
+
+  if (newSize == 0) {
+    free(pointer);
+    return NULL;
+  }
+
+  void* result = realloc(pointer, newSize);
+  if (result == NULL) {
+    reclaimMemory();
+    result = realloc(pointer, newSize);
+    if (result == NULL) outOfMemory(oldSize, newSize);
+  }
+  return result;
+}
+
+static double microseconds() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return now.tv_sec * 1e6 + now.tv_usec;
+}
+
+Value gfx_millis() { return NUMBER_VAL((unsigned long)(microseconds() / 1000)); }
+Value gfx_micros() { return NUMBER_VAL((unsigned long)microseconds()); }
+Value gfx_delay(unsigned long ms) { return NIL_VAL; }
+Value gfx_delayMicroseconds(unsigned us) { return NIL_VAL; }
+Value gfx_pinMode(int pin, const char* mode_c_str) { return NIL_VAL; }
+Value gfx_digitalWrite(int pin, bool level) { return NIL_VAL; }
+Value gfx_digitalRead(int pin) { return BOOL_VAL(false); }
+Value gfx_analogWriteResolution(int bits) { return NIL_VAL; }
+Value gfx_analogWrite(int pin, int level) { return NIL_VAL; }
+Value gfx_analogReadResolution(int bits) { return NIL_VAL; }
+Value gfx_analogRead(int pin) { return NUMBER_VAL(0); }
+Value gfx_analogReference(uint8_t r) { return NIL_VAL; }
+Value gfx_bit(unsigned b) { return NUMBER_VAL(1UL << b); }
+Value gfx_bitClear(unsigned long n, unsigned b) { return NUMBER_VAL(n & ~(1UL << b)); }
+Value gfx_bitRead(unsigned long n, unsigned b) { return NUMBER_VAL((n >> b) & 1); }
+Value gfx_bitSet(unsigned long n, unsigned b) { return NUMBER_VAL(n | (1UL << b)); }
+Value gfx_highByte(unsigned long n) { return NUMBER_VAL((n >> 8) & 0xff); }
+Value gfx_lowByte(unsigned long n) { return NUMBER_VAL(n & 0xff); }
+Value gfx_isRotated() { return BOOL_VAL(false); }
+Value gfx_beginDraw() { return NIL_VAL; }
+Value gfx_endDraw() { return NIL_VAL; }
+Value gfx_width() { return NUMBER_VAL(800); }
+Value gfx_height() { return NUMBER_VAL(480); }
+Value gfx_fill(int r, int g, int b) { return NIL_VAL; }
+Value gfx_noFill() { return NIL_VAL; }
+Value gfx_stroke(int r, int g, int b) { return NIL_VAL; }
+Value gfx_noStroke() { return NIL_VAL; }
+Value gfx_background(int r, int g, int b) { return NIL_VAL; }
+Value gfx_clear() { return NIL_VAL; }
+Value gfx_circle(int x, int y, int diameter) { return NIL_VAL; }
+Value gfx_ellipse(int x, int y, int width, int height) { return NIL_VAL; }
+Value gfx_line(int x1, int y1, int x2, int y2) { return NIL_VAL; }
+Value gfx_point(int x, int y) { return NIL_VAL; }
+Value gfx_rect(int x, int y, int width, int height) { return NIL_VAL; }
+Value gfx_text(const char* text_c_str, int x, int y) { return NIL_VAL; }
+Value gfx_textFont(const char* font_c_str) { return NIL_VAL; }
+Value gfx_textFontWidth() { return NUMBER_VAL(5); }
+Value gfx_textFontHeight() { return NUMBER_VAL(7); }
+Value gfx_beginText(int x, int y, int r, int g, int b) { return NIL_VAL; }
+Value gfx_endText(const char* scroll_type_c_str) { return NIL_VAL; }
+Value gfx_textScrollSpeed(unsigned long speed) { return NIL_VAL; }
+Value gfx_printStr(const char* text) { return NIL_VAL; }
+Value gfx_printStrLn(const char* text) { return NIL_VAL; }
+Value gfx_printInt(long long num, int base) { return NIL_VAL; }
+Value gfx_printFloat(double num, int digits) { return NIL_VAL; }
@@ -0,0 +1,124 @@
+// Runs Lox scripts on a desktop machine with the same interpreter the
+// sketch uses, for testing and benchmarking the language without a
+// board. The board functions come from board.c.
+//
+// Build from this directory with:
+//   cc -O2 -I../../src host.c board.c ../../src/*.c -lm -lpthread -o clox
+//   ./clox script.lox...
+// adding -DCLOX_JIT on x86-64 to compile hot functions to machine code,
+// and run the tests with:
+//   ./run_tests.sh
+//
+// With --bytecode first, each script is compiled but not run, and the
+// memory its bytecode takes up is printed instead. With --stream n,
+// scripts are read through interpretStream() n bytes at a time, as the
+// sketch reads files, which run_tests.sh can be given to test that:
+//   ./run_tests.sh --stream 7
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "vm.h"
+
+static char* readFile(const char* path) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) {
+    fprintf(stderr, "Could not open file \"%s\".\n", path);
+    exit(74);
+  }
+
+  fseek(file, 0L, SEEK_END);
+  size_t fileSize = ftell(file);
+  rewind(file);
+
+  char* buffer = (char*)malloc(fileSize + 1);
+  size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
+  buffer[bytesRead] = '\0';
+  fclose(file);
+  return buffer;
+}
+
+// The bytes of code, line tables and constants in a function and the
+// functions nested in it.
+static size_t bytecodeSize(ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  size_t size = chunk->capacity + chunk->linesLength +
+                chunk->constants.capacity * sizeof(Value);
+  for (int i = 0; i < chunk->constants.count; i++) {
+    if (IS_FUNCTION(chunk->constants.values[i])) {
+      size += bytecodeSize(AS_FUNCTION(chunk->constants.values[i]));
+    }
+  }
+  return size;
+}
+static InterpretResult printBytecodeSize(const char* path,
+                                         const char* source) {
+  ObjFunction* function = compile(source);
+  if (function == NULL) return INTERPRET_COMPILE_ERROR;
+
+  printf("%s: %zu bytes\n", path, bytecodeSize(function));
+  return INTERPRET_OK;
+}
+
+typedef struct {
+  FILE* file;
+  int readSize;
+} StreamSource;
+
+static int readStream(void* context, char* buffer, int size) {
+  StreamSource* source = (StreamSource*)context;
+  if (size > source->readSize) size = source->readSize;
+  return (int)fread(buffer, sizeof(char), size, source->file);
+}
+static InterpretResult interpretFile(const char* path, int readSize) {
+  StreamSource source;
+  source.file = fopen(path, "rb");
+  if (source.file == NULL) {
+    fprintf(stderr, "Could not open file \"%s\".\n", path);
+    exit(74);
+  }
+  source.readSize = readSize;
+
+  InterpretResult result = interpretStream(readStream, &source);
+  fclose(source.file);
+  return result;
+}
+
+int main(int argc, const char* argv[]) {
+  bool sizesOnly = false;
+  int readSize = 0;
+  int first = 1;
+  if (argc > first && strcmp(argv[first], "--bytecode") == 0) {
+    sizesOnly = true;
+    first++;
+  } else if (argc > first + 1 && strcmp(argv[first], "--stream") == 0) {
+    readSize = atoi(argv[first + 1]);
+    first += 2;
+  }
+  if (argc <= first || (first > 1 && !sizesOnly && readSize <= 0)) {
+    fprintf(stderr,
+            "Usage: clox [--bytecode | --stream bytes] script.lox...\n");
+    return 64;
+  }
+
+  initVM();
+  int status = 0;
+  for (int i = first; i < argc; i++) {
+    InterpretResult result;
+    if (readSize > 0) {
+      result = interpretFile(argv[i], readSize);
+    } else {
+      char* source = readFile(argv[i]);
+      result = sizesOnly ? printBytecodeSize(argv[i], source)
+                         : interpret(source);
+      free(source);
+    }
+
+    if (result == INTERPRET_COMPILE_ERROR) status = 65;
+    if (result == INTERPRET_RUNTIME_ERROR) status = 70;
+  }
+  freeVM();
+  return status;
+}
@@ -0,0 +1,25 @@
+#!/bin/sh
+# Runs each script in tests/ and compares everything it prints with the
+# "// expect: " comments in the script, in order. The scripts in a
+# directory under tests/ are run one after another in the same VM. Any
+# arguments are passed to clox before the script names, and with
+# --stream the scripts in stream_tests/ are run as well.
+
+cd "$(dirname "$0")"
+failed=0
+streamed=
+[ "$1" = --stream ] && streamed=stream_tests/*.lox
+for test in tests/*.lox tests/*/ $streamed; do
+  scripts=$(ls -d "$test"*.lox 2>/dev/null || echo "$test")
+  [ -d "$test" ] && scripts=$(ls "$test"*.lox)
+  expected=$(sed -n 's|.*// expect: ||p' $scripts)
+  actual=$(./clox "$@" $scripts 2>&1)
+  if [ "$actual" != "$expected" ]; then
+    echo "FAIL $test"
+    printf '%s\n' "$actual" > /tmp/clox_actual.txt
+    printf '%s\n' "$expected" | diff - /tmp/clox_actual.txt
+    failed=1
+  fi
+done
+[ $failed = 0 ] && echo "All tests passed."
+exit $failed
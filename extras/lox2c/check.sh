@@ -0,0 +1,56 @@
+#!/bin/sh
+# Translates each script in ../host/tests with lox2c, builds it with
+# the interpreter and compares what it prints with the "// expect: "
+# comments in the script, as ../host/run_tests.sh does. Scripts lox2c
+# can't compile are checked against the errors it prints instead. With
+# --image first, the scripts are run from their bytecode images alone,
+# without the translated code. Any other arguments are passed to the C
+# compiler.
+
+cd "$(dirname "$0")"
+compiled=-DCLOX_COMPILED_CODE
+if [ "$1" = "--image" ]; then
+  compiled=
+  shift
+fi
+build=$(mktemp -d)
+trap 'rm -rf "$build"' EXIT
+
+cc -O2 -I../../src lox2c.c ../host/board.c ../../src/*.c -lm -lpthread \
+   -o "$build/lox2c" || exit 1
+for source in ../host/board.c ../../src/*.c; do
+  cc -c -O2 $compiled "$@" -I../../src "$source" \
+     -o "$build/$(basename "$source" .c).o" || exit 1
+done
+
+failed=0
+for test in ../host/tests/*.lox; do
+  expected=$(sed -n 's|.*// expect: ||p' "$test")
+  if actual=$("$build/lox2c" "$test" script 2>&1 > "$build/script.c"); then
+    cc -O2 -Wall $compiled "$@" -I../../src "$build/script.c" \
+       run_script.c "$build"/*.o -lm -lpthread -o "$build/script" || exit 1
+    actual=$("$build/script" 2>&1)
+  else
+    actual=$(cat "$build/script.c"; printf '%s' "$actual")
+  fi
+  if [ "$actual" != "$expected" ]; then
+    echo "FAIL $test"
+    printf '%s\n' "$actual" > /tmp/lox2c_actual.txt
+    printf '%s\n' "$expected" | diff - /tmp/lox2c_actual.txt
+    failed=1
+  fi
+done
+# Calls to the board's pure natives are left to the board, not folded
+# into constants with what the host stubs return (800 and 2^31 here),
+# so the only number in the script's code is the argument 31.
+printf 'var w = width();\nvar b = bit(31);\n' > "$build/board.lox"
+"$build/lox2c" "$build/board.lox" script > "$build/board.c" || exit 1
+folded=$(grep -o 'NUMBER_VAL([^)]*)' "$build/board.c")
+if [ "$folded" != "NUMBER_VAL(0x1.fp+4)" ]; then
+  echo "FAIL board natives folded:"
+  printf '%s\n' "$folded"
+  failed=1
+fi
+
+[ $failed = 0 ] && echo "All tests passed."
+exit $failed
@@ -0,0 +1,255 @@
+// Translates a Lox script to C, for scripts that are shipped as part of
+// the sketch. The output holds the script's bytecode image, as `dump`
+// prints it, and a C function for each function in the script, which
+// runs the instructions that are simple and common (arithmetic, locals,
+// globals that are read, jumps and loops) without going through the
+// interpreter's dispatch. Every other instruction, and any operand of
+// the wrong type, is left to run(), which picks the C function up again
+// at the instruction after.
+//
+// Build from this directory with:
+//   cc -O2 -I../../src lox2c.c ../host/board.c ../../src/*.c -lm -lpthread -o lox2c
+//   ./lox2c script.lox script_lox > script_lox.c
+// and build the output into the sketch with CLOX_COMPILED_CODE defined
+// in common.h, to run it with:
+//   extern const uint8_t script_lox[];
+//   extern const CompiledCode script_lox_code[];
+//   interpretCompiledImage(script_lox, script_lox_code);
+// Without CLOX_COMPILED_CODE only the image is built, which runs with
+// interpretImage(script_lox).
+//
+// check.sh translates each test in extras/host/tests and checks that it
+// still prints what it expects, and with --image checks the same for
+// the images alone.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "chunk.h"
+#include "compiler.h"
+#include "image.h"
+#include "vm.h"
+
+static char* readFile(const char* path) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) {
+    fprintf(stderr, "Could not open file \"%s\".\n", path);
+    exit(74);
+  }
+
+  fseek(file, 0L, SEEK_END);
+  size_t fileSize = ftell(file);
+  rewind(file);
+
+  char* buffer = (char*)malloc(fileSize + 1);
+  size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
+  buffer[bytesRead] = '\0';
+  fclose(file);
+  return buffer;
+}
+
+// Numbers are written into the C code, unless C has no literal for them.
+static bool isWrittenOut(Value value) {
+  return IS_NUMBER(value) && isfinite(AS_NUMBER(value));
+}
+
+static bool usesSlots(Chunk* chunk) {
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    uint8_t instruction = chunk->code[offset];
+    if (instruction == OP_GET_LOCAL || instruction == OP_SET_LOCAL) {
+      return true;
+    }
+  }
+  return false;
+}
+static bool usesConstants(Chunk* chunk) {
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    uint8_t instruction = chunk->code[offset];
+    if (instruction == OP_GET_GLOBAL ||
+        (instruction == OP_CONSTANT &&
+         !isWrittenOut(chunk->constants.values[chunk->code[offset + 1]]))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void binaryOp(int offset, const char* type, const char* op) {
+  printf("  if (!IS_NUMBER(sp[-2]) || !IS_NUMBER(sp[-1])) EXIT(%d);\n",
+         offset);
+  printf("  sp[-2] = %s(AS_NUMBER(sp[-2]) %s AS_NUMBER(sp[-1]));\n",
+         type, op);
+  printf("  sp--;\n");
+}
+
+static void translateInstruction(Chunk* chunk, int offset) {
+  uint8_t* code = chunk->code;
+#define OPERAND() (code[offset + 1])
+#define JUMP_TARGET(sign) \
+    (offset + 3 + (sign) * ((code[offset + 1] << 8) | code[offset + 2]))
+
+  printf("op%d:\n", offset);
+  switch (code[offset]) {
+    case OP_CONSTANT: {
+      Value value = chunk->constants.values[OPERAND()];
+      if (isWrittenOut(value)) {
+        // Hexadecimal keeps every bit of the number.
+        printf("  PUSH(NUMBER_VAL(%a));\n", AS_NUMBER(value));
+      } else {
+        printf("  PUSH(constants[%d]);\n", OPERAND());
+      }
+      break;
+    }
+    case OP_NIL:   printf("  PUSH(NIL_VAL);\n"); break;
+    case OP_TRUE:  printf("  PUSH(BOOL_VAL(true));\n"); break;
+    case OP_FALSE: printf("  PUSH(BOOL_VAL(false));\n"); break;
+    case OP_POP:   printf("  sp--;\n"); break;
+    case OP_GET_LOCAL:
+      printf("  PUSH(slots[%d]);\n", OPERAND());
+      break;
+    case OP_SET_LOCAL:
+      printf("  slots[%d] = sp[-1];\n", OPERAND());
+      break;
+    case OP_GET_GLOBAL:
+      // An undefined variable is left for the interpreter to report.
+      printf("  if (!tableGet(&vm.globals, AS_STRING(constants[%d]), sp)) "
+             "EXIT(%d);\n", OPERAND(), offset);
+      printf("  sp++;\n");
+      break;
+    case OP_GET_UPVALUE:
+      printf("  PUSH(*frame->closure->upvalues[%d]->location);\n",
+             OPERAND());
+      break;
+    case OP_GET_ENCLOSING:
+      printf("  PUSH(frame[-1].slots[%d]);\n", OPERAND());
+      break;
+    case OP_SET_ENCLOSING:
+      printf("  frame[-1].slots[%d] = sp[-1];\n", OPERAND());
+      break;
+    case OP_EQUAL:
+      printf("  sp[-2] = BOOL_VAL(valuesEqual(sp[-2], sp[-1]));\n");
+      printf("  sp--;\n");
+      break;
+    case OP_GREATER:  binaryOp(offset, "BOOL_VAL", ">"); break;
+    case OP_LESS:     binaryOp(offset, "BOOL_VAL", "<"); break;
+    // Strings and lists are added by the interpreter.
+    case OP_ADD:      binaryOp(offset, "NUMBER_VAL", "+"); break;
+    case OP_SUBTRACT: binaryOp(offset, "NUMBER_VAL", "-"); break;
+    case OP_MULTIPLY: binaryOp(offset, "NUMBER_VAL", "*"); break;
+    case OP_DIVIDE:   binaryOp(offset, "NUMBER_VAL", "/"); break;
+    case OP_NOT:
+      printf("  sp[-1] = BOOL_VAL(FALSEY(sp[-1]));\n");
+      break;
+    case OP_NEGATE:
+      printf("  if (!IS_NUMBER(sp[-1])) EXIT(%d);\n", offset);
+      printf("  sp[-1] = NUMBER_VAL(-AS_NUMBER(sp[-1]));\n");
+      break;
+    case OP_JUMP:
+    case OP_LOOP:
+      printf("  goto op%d;\n",
+             JUMP_TARGET(code[offset] == OP_JUMP ? 1 : -1));
+      break;
+    case OP_JUMP_IF_FALSE:
+      printf("  if (FALSEY(sp[-1])) goto op%d;\n", JUMP_TARGET(1));
+      break;
+    default:
+      printf("  EXIT(%d);\n", offset);
+      break;
+  }
+
+#undef OPERAND
+#undef JUMP_TARGET
+}
+
+static void translateFunction(ObjFunction* function, const char* name,
+                              int index) {
+  Chunk* chunk = &function->chunk;
+  printf("\n// %s\n", function->name != NULL ? function->name->chars
+                                             : "<script>");
+  printf("static void %s_%d(struct CallFrame* frame) {\n", name, index);
+  printf("  uint8_t* code = frame->closure->function->chunk.code;\n");
+  if (usesConstants(chunk)) {
+    printf("  Value* constants = "
+           "frame->closure->function->chunk.constants.values;\n");
+  }
+  if (usesSlots(chunk)) printf("  Value* slots = frame->slots;\n");
+  printf("  Value* sp = vm.stackTop;\n");
+
+  printf("  switch (frame->ip - code) {\n");
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    printf("    case %d: goto op%d;\n", offset, offset);
+  }
+  printf("    default: return;\n");
+  printf("  }\n");
+
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    translateInstruction(chunk, offset);
+  }
+  printf("}\n");
+}
+
+// Functions are numbered in the order the image holds them, which is
+// the order loadCompiledImage() hands the C functions out in.
+static int translateFunctions(ObjFunction* function, const char* name,
+                              int index) {
+  int next = index + 1;
+  translateFunction(function, name, index);
+  ValueArray* constants = &function->chunk.constants;
+  for (int i = 0; i < constants->count; i++) {
+    if (IS_FUNCTION(constants->values[i])) {
+      next = translateFunctions(AS_FUNCTION(constants->values[i]), name,
+                                next);
+    }
+  }
+  return next;
+}
+
+int main(int argc, const char* argv[]) {
+  if (argc != 3) {
+    fprintf(stderr, "Usage: lox2c script.lox name\n");
+    return 64;
+  }
+
+  initVM();
+  // The pure natives here are the host's stubs, so calls to them are
+  // left for the board to make.
+  vm.foldPureCalls = false;
+  char* source = readFile(argv[1]);
+  ObjFunction* function = compile(source);
+  free(source);
+  if (function == NULL) return 65;
+  push(OBJ_VAL(function));
+
+  const char* name = argv[2];
+  printf("// Translated from %s by extras/lox2c.\n\n", argv[1]);
+  printf("#include \"vm.h\"\n\n");
+  dumpImage(function, name);
+
+  // Without CLOX_COMPILED_CODE the image can still be run on its own
+  // with interpretImage().
+  printf("\n#ifdef CLOX_COMPILED_CODE\n");
+  printf("\n#define PUSH(value) (*sp++ = (value))\n");
+  printf("#define FALSEY(value) \\\n"
+         "    (IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value)))\n");
+  printf("#define EXIT(offset) \\\n"
+         "    do { \\\n"
+         "      frame->ip = code + (offset); \\\n"
+         "      vm.stackTop = sp; \\\n"
+         "      return; \\\n"
+         "    } while (false)\n");
+  int count = translateFunctions(function, name, 0);
+
+  printf("\nconst CompiledCode %s_code[] = {\n", name);
+  for (int i = 0; i < count; i++) printf("  %s_%d,\n", name, i);
+  printf("};\n");
+  printf("\n#endif\n");
+
+  pop();
+  freeVM();
+  return 0;
+}
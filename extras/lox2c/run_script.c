@@ -0,0 +1,22 @@
+// Runs a script lox2c translated under the name "script", for check.sh.
+
+#include "vm.h"
+
+extern const uint8_t script[];
+#ifdef CLOX_COMPILED_CODE
+extern const CompiledCode script_code[];
+#endif
+
+int main(void) {
+  initVM();
+#ifdef CLOX_COMPILED_CODE
+  InterpretResult result = interpretCompiledImage(script, script_code);
+#else
+  InterpretResult result = interpretImage(script);
+#endif
+  freeVM();
+
+  if (result == INTERPRET_COMPILE_ERROR) return 65;
+  if (result == INTERPRET_RUNTIME_ERROR) return 70;
+  return 0;
+}
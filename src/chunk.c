@@ -9,31 +9,119 @@ void initChunk(Chunk* chunk) {
   chunk->capacity = 0;
   chunk->code = NULL;
   chunk->lines = NULL;
+  chunk->linesLength = 0;
   initValueArray(&chunk->constants);
 }
 void freeChunk(Chunk* chunk) {
   FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(int, chunk->lines, chunk->capacity);
+  FREE_ARRAY(uint8_t, chunk->lines, chunk->linesLength);
   freeValueArray(&chunk->constants);
   initChunk(chunk);
 }
-void writeChunk(Chunk* chunk, uint8_t byte, int line) {
-  if (chunk->capacity < chunk->count + 1) {
-    int oldCapacity = chunk->capacity;
-    chunk->capacity = GROW_CAPACITY(oldCapacity);
-    chunk->code = GROW_ARRAY(uint8_t, chunk->code,
-        oldCapacity, chunk->capacity);
-    chunk->lines = GROW_ARRAY(int, chunk->lines,
-        oldCapacity, chunk->capacity);
-  }
-
-  chunk->code[chunk->count] = byte;
-  chunk->lines[chunk->count] = line;
-  chunk->count++;
-}
 int addConstant(Chunk* chunk, Value value) {
   push(value);
   writeValueArray(&chunk->constants, value);
   pop();
   return chunk->constants.count - 1;
 }
+// Writes a run to lines, or only measures it if lines is NULL.
+static int writeRun(uint8_t* lines, int length, int delta) {
+  uint32_t value = ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+  int size = 0;
+  if (lines != NULL) lines[size] = (uint8_t)length;
+  size++;
+
+  do {
+    uint8_t byte = value & 0x7f;
+    value >>= 7;
+    if (value != 0) byte |= 0x80;
+    if (lines != NULL) lines[size] = byte;
+    size++;
+  } while (value != 0);
+  return size;
+}
+static int writeRuns(uint8_t* runs, const int* lines, int count) {
+  int size = 0;
+  int previous = 0;
+  for (int start = 0; start < count;) {
+    int length = 1;
+    while (start + length < count && length < UINT8_MAX &&
+           lines[start + length] == lines[start]) {
+      length++;
+    }
+
+    size += writeRun(runs != NULL ? runs + size : NULL, length,
+                     lines[start] - previous);
+    previous = lines[start];
+    start += length;
+  }
+  return size;
+}
+// Encodes the line of each byte of code.
+void setLines(Chunk* chunk, const int* lines) {
+  int length = writeRuns(NULL, lines, chunk->count);
+  uint8_t* runs = ALLOCATE(uint8_t, length);
+  writeRuns(runs, lines, chunk->count);
+  chunk->lines = runs;
+  chunk->linesLength = length;
+}
+// Decodes runs until the one holding offset, as lines are only needed
+// for errors and disassembly. Returns 0 if there are none.
+int getLine(Chunk* chunk, int offset) {
+  const uint8_t* run = chunk->lines;
+  const uint8_t* end = chunk->lines + chunk->linesLength;
+  int start = 0;
+  int line = 0;
+  while (run < end) {
+    start += *run++;
+
+    uint32_t value = 0;
+    int shift = 0;
+    uint8_t byte;
+    do {
+      byte = *run++;
+      value |= (uint32_t)(byte & 0x7f) << shift;
+      shift += 7;
+    } while (byte & 0x80);
+    line += (int)(value >> 1) ^ -(int)(value & 1);
+
+    if (offset < start) return line;
+  }
+  return 0;
+}
+// Size of the instruction at offset, with its operands.
+int instructionLength(Chunk* chunk, int offset) {
+  switch (chunk->code[offset]) {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_BUILD_LIST:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_ENCLOSING:
+    case OP_SET_ENCLOSING:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_CALL:
+    case OP_CLASS:
+    case OP_METHOD:
+      return 2;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+      return 3;
+    case OP_CLOSURE: {
+      ObjFunction* function = AS_FUNCTION(
+          chunk->constants.values[chunk->code[offset + 1]]);
+      return 2 + 2 * function->upvalueCount;
+    }
+    default:
+      return 1;
+  }
+}
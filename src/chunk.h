@@ -20,6 +20,8 @@ typedef enum {
   OP_STORE_SUBSCR,
   OP_GET_UPVALUE,
   OP_SET_UPVALUE,
+  OP_GET_ENCLOSING,
+  OP_SET_ENCLOSING,
   OP_GET_PROPERTY,
   OP_SET_PROPERTY,
   OP_GET_SUPER,
@@ -51,13 +53,19 @@ typedef struct {
   int count;
   int capacity;
   uint8_t* code;
-  int* lines;
+  // Line numbers are stored as runs of code from the same line. Each run
+  // is its length, from 1 to 255 bytes, followed by the difference from
+  // the line of the run before as a zigzag varint.
+  uint8_t* lines;
+  int linesLength;
   ValueArray constants;
 } Chunk;
 
 void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
-void writeChunk(Chunk* chunk, uint8_t byte, int line);
 int addConstant(Chunk* chunk, Value value);
+void setLines(Chunk* chunk, const int* lines);
+int getLine(Chunk* chunk, int offset);
+int instructionLength(Chunk* chunk, int offset);
 
 #endif
@@ -52,6 +52,9 @@ Value gfx_printFloat(double num, int digits);
 #define GFX_DECLARE(type) \
   defineNative(#type, gfx##type##Native)
 
+#define GFX_DECLARE_PURE(type, arity) \
+  definePureNative(#type, gfx##type##Native, arity)
+
 #define GFX_ARGS_0
 #define GFX_ARGS_1 AS_NUMBER(args[0])
 #define GFX_ARGS_2 AS_NUMBER(args[0]), AS_NUMBER(args[1])
@@ -6,6 +6,32 @@
 #include <stdint.h>
 
 #define NAN_BOXING
+
+// Dispatch bytecode through a table of label addresses (a GCC/Clang
+// extension) instead of a switch statement.
+#if defined(__GNUC__)
+#define COMPUTED_GOTO
+#endif
+
+// Host builds with pthreads can mark the heap with several threads by
+// defining CLOX_PARALLEL_GC as the most to use, counting the one that
+// runs the VM (for example -DCLOX_PARALLEL_GC=8).
+
+// Host builds for x86-64 Linux or macOS can compile functions which are
+// run often to machine code by defining CLOX_JIT (see jit.h).
+
+// Defining CLOX_COMPILED_CODE lets run() call functions translated to C
+// ahead of time by extras/lox2c, which the JIT also relies on.
+//#define CLOX_COMPILED_CODE
+#ifdef CLOX_JIT
+#define CLOX_COMPILED_CODE
+#endif
+
+// Defining CLOX_STRIP_DEBUG_INFO leaves line numbers and function names
+// out of compiled code, which saves memory but leaves runtime errors
+// without a stack trace.
+//#define CLOX_STRIP_DEBUG_INFO
+
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
 
@@ -4,6 +4,7 @@
 
 #include "common.h"
 #include "compiler.h"
+#include "dtoa.h"
 #include "memory.h"
 #include "scanner.h"
 
@@ -42,9 +43,11 @@ typedef struct {
 } ParseRule;
 
 typedef struct {
-  Token name;
+  ObjString* name;
   int depth;
   bool isCaptured;
+  bool escapes;
+  int closureOffset;
 } Local;
 typedef struct {
   uint8_t index;
@@ -61,11 +64,15 @@ typedef struct Compiler {
   struct Compiler* enclosing;
   ObjFunction* function;
   FunctionType type;
+  // The line of each byte of code, encoded by finishChunk().
+  int* lines;
 
-  Local locals[UINT8_COUNT];
+  Local* locals;
   int localCount;
+  int localCapacity;
   Upvalue upvalues[UINT8_COUNT];
   int scopeDepth;
+  int lastGlobalGet;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -77,6 +84,81 @@ Parser parser;
 Compiler* current = NULL;
 ClassCompiler* currentClass = NULL;
 
+// What is only needed while compiling is allocated from an arena: the
+// compilers, their locals and the code of the functions being compiled.
+// A function's share is released once it has been compiled and the
+// rest when compiling ends, so only finished code reaches the heap.
+#define ARENA_BLOCK_SIZE 4096
+#define ARENA_ALIGN(size) \
+    (((size) + sizeof(double) - 1) & ~(sizeof(double) - 1))
+
+typedef struct ArenaBlock {
+  struct ArenaBlock* previous;
+  size_t size;
+  size_t used;
+  double data[];
+} ArenaBlock;
+
+typedef struct {
+  ArenaBlock* block;
+  size_t used;
+} ArenaMark;
+
+static ArenaBlock* arena = NULL;
+
+static void* arenaAllocate(size_t size) {
+  size = ARENA_ALIGN(size);
+  if (arena == NULL || arena->size - arena->used < size) {
+    size_t blockSize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+    ArenaBlock* block = (ArenaBlock*)reallocate(NULL, 0,
+        sizeof(ArenaBlock) + blockSize);
+    block->previous = arena;
+    block->size = blockSize;
+    block->used = 0;
+    arena = block;
+  }
+
+  void* result = (char*)arena->data + arena->used;
+  arena->used += size;
+  return result;
+}
+// The last allocation grows in place if there's room. Otherwise the old
+// allocation is left unused until it is released.
+static void* arenaGrow(void* pointer, size_t oldSize, size_t newSize) {
+  char* top = (char*)arena->data + arena->used;
+  if (pointer != NULL && (char*)pointer + ARENA_ALIGN(oldSize) == top &&
+      arena->size - arena->used >= ARENA_ALIGN(newSize) -
+                                    ARENA_ALIGN(oldSize)) {
+    arena->used += ARENA_ALIGN(newSize) - ARENA_ALIGN(oldSize);
+    return pointer;
+  }
+
+  void* result = arenaAllocate(newSize);
+  if (oldSize > 0) memcpy(result, pointer, oldSize);
+  return result;
+}
+static ArenaMark arenaMark() {
+  ArenaMark mark = {arena, arena != NULL ? arena->used : 0};
+  return mark;
+}
+static void arenaRelease(ArenaMark mark) {
+  while (arena != mark.block) {
+    ArenaBlock* previous = arena->previous;
+    reallocate(arena, sizeof(ArenaBlock) + arena->size, 0);
+    arena = previous;
+  }
+  if (arena != NULL) arena->used = mark.used;
+}
+static bool isInArena(void* pointer) {
+  for (ArenaBlock* block = arena; block != NULL; block = block->previous) {
+    if ((char*)pointer >= (char*)block->data &&
+        (char*)pointer < (char*)block->data + block->size) {
+      return true;
+    }
+  }
+  return false;
+}
+
 static Chunk* currentChunk() {
   return &current->function->chunk;
 }
@@ -130,8 +212,26 @@ static bool match(TokenType type) {
   advance();
   return true;
 }
+static void reserveCode(Compiler* compiler, int count) {
+  Chunk* chunk = &compiler->function->chunk;
+  if (chunk->capacity >= count) return;
+
+  int capacity = chunk->capacity;
+  while (capacity < count) capacity = GROW_CAPACITY(capacity);
+  uint8_t* code = (uint8_t*)arenaGrow(chunk->code,
+      sizeof(uint8_t) * chunk->capacity, sizeof(uint8_t) * capacity);
+  int* lines = (int*)arenaGrow(compiler->lines,
+      sizeof(int) * chunk->capacity, sizeof(int) * capacity);
+  chunk->code = code;
+  compiler->lines = lines;
+  chunk->capacity = capacity;
+}
 static void emitByte(uint8_t byte) {
-  writeChunk(currentChunk(), byte, parser.previous.line);
+  Chunk* chunk = currentChunk();
+  reserveCode(current, chunk->count + 1);
+  chunk->code[chunk->count] = byte;
+  current->lines[chunk->count] = parser.previous.line;
+  chunk->count++;
 }
 static void emitBytes(uint8_t byte1, uint8_t byte2) {
   emitByte(byte1);
@@ -163,6 +263,7 @@ static void emitReturn() {
 }
 static uint8_t makeConstant(Value value) {
   int constant = addConstant(currentChunk(), value);
+  WRITE_BARRIER(current->function, value);
   if (constant > UINT8_MAX) {
     error("Too many constants in one chunk.");
     return 0;
@@ -184,34 +285,124 @@ static void patchJump(int offset) {
   currentChunk()->code[offset] = (jump >> 8) & 0xff;
   currentChunk()->code[offset + 1] = jump & 0xff;
 }
-static void initCompiler(Compiler* compiler, FunctionType type) {
+// Locals grow on demand, up to the UINT8_COUNT slots a frame has.
+static Local* pushLocal(ObjString* name) {
+  if (current->localCount == current->localCapacity) {
+    int capacity = GROW_CAPACITY(current->localCapacity);
+    push(OBJ_VAL(name));
+    current->locals = (Local*)arenaGrow(current->locals,
+        sizeof(Local) * current->localCapacity, sizeof(Local) * capacity);
+    pop();
+    current->localCapacity = capacity;
+  }
+
+  Local* local = &current->locals[current->localCount++];
+  local->name = name;
+  return local;
+}
+static Compiler* newCompiler(FunctionType type) {
+  Compiler* compiler = (Compiler*)arenaAllocate(sizeof(Compiler));
   compiler->enclosing = current;
   compiler->function = NULL;
   compiler->type = type;
+  compiler->lines = NULL;
+  compiler->locals = NULL;
   compiler->localCount = 0;
+  compiler->localCapacity = 0;
   compiler->scopeDepth = 0;
+  compiler->lastGlobalGet = -1;
   compiler->function = newFunction();
   current = compiler;
+#ifndef CLOX_STRIP_DEBUG_INFO
   if (type != TYPE_SCRIPT) {
     current->function->name = copyString(parser.previous.start,
                                          parser.previous.length);
+    WRITE_BARRIER(current->function, OBJ_VAL(current->function->name));
   }
+#endif
 
-  Local* local = &current->locals[current->localCount++];
+  ObjString* name = type != TYPE_FUNCTION ? copyString("this", 4)
+                                          : copyString("", 0);
+  Local* local = pushLocal(name);
   local->depth = 0;
   local->isCaptured = false;
-  if (type != TYPE_FUNCTION) {
-    local->name.start = "this";
-    local->name.length = 4;
-  } else {
-    local->name.start = "";
-    local->name.length = 0;
+  local->escapes = true;
+  local->closureOffset = -1;
+  return compiler;
+}
+// A local function which is only ever called by name from the frame
+// that declared it cannot outlive that frame, so it can read and write
+// the locals it captures straight from its caller's stack slots
+// instead of through ObjUpvalues.
+static void bindToEnclosingFrame(Local* local) {
+  if (local->escapes || local->isCaptured ||
+      local->closureOffset == -1) {
+    return;
   }
+
+  Chunk* chunk = currentChunk();
+  uint8_t* closure = &chunk->code[local->closureOffset];
+  ObjFunction* function = AS_FUNCTION(chunk->constants.values[closure[1]]);
+  if (function->upvalueCount == 0) return;
+
+  for (int i = 0; i < function->upvalueCount; i++) {
+    if (!closure[2 + 2 * i]) return; // Not a local of this frame.
+  }
+
+  // Closures nested inside the function may share its upvalues, which
+  // then have to exist.
+  Chunk* body = &function->chunk;
+  for (int offset = 0; offset < body->count;
+       offset += instructionLength(body, offset)) {
+    if (body->code[offset] != OP_CLOSURE) continue;
+    ObjFunction* inner = AS_FUNCTION(
+        body->constants.values[body->code[offset + 1]]);
+    for (int i = 0; i < inner->upvalueCount; i++) {
+      if (!body->code[offset + 2 + 2 * i]) return;
+    }
+  }
+
+  for (int offset = 0; offset < body->count;
+       offset += instructionLength(body, offset)) {
+    uint8_t* instruction = &body->code[offset];
+    if (instruction[0] == OP_GET_UPVALUE) {
+      instruction[0] = OP_GET_ENCLOSING;
+    } else if (instruction[0] == OP_SET_UPVALUE) {
+      instruction[0] = OP_SET_ENCLOSING;
+    } else {
+      continue;
+    }
+    instruction[1] = closure[3 + 2 * instruction[1]];
+  }
+  function->usesEnclosingFrame = true;
+}
+// Copies finished code out of the arena into an array of its final
+// size, along with its encoded lines, and trims the constants to fit.
+static void finishChunk(Compiler* compiler) {
+  Chunk* chunk = &compiler->function->chunk;
+#ifndef CLOX_STRIP_DEBUG_INFO
+  setLines(chunk, compiler->lines);
+#endif
+
+  uint8_t* code = ALLOCATE(uint8_t, chunk->count);
+  memcpy(code, chunk->code, sizeof(uint8_t) * chunk->count);
+  chunk->code = code;
+  chunk->capacity = chunk->count;
+
+  ValueArray* constants = &chunk->constants;
+  constants->values = GROW_ARRAY(Value, constants->values,
+                                 constants->capacity, constants->count);
+  constants->capacity = constants->count;
 }
 static ObjFunction* endCompiler() {
   emitReturn();
   ObjFunction* function = current->function;
 
+  for (int i = current->localCount - 1; i > 0; i--) {
+    bindToEnclosingFrame(&current->locals[i]);
+  }
+  finishChunk(current);
+
 #ifdef DEBUG_PRINT_CODE
   if (!parser.hadError) {
     disassembleChunk(currentChunk(), function->name != NULL
@@ -231,6 +422,7 @@ static void endScope() {
   while (current->localCount > 0 &&
          current->locals[current->localCount - 1].depth >
             current->scopeDepth) {
+    bindToEnclosingFrame(&current->locals[current->localCount - 1]);
     if (current->locals[current->localCount - 1].isCaptured) {
       emitByte(OP_CLOSE_UPVALUE);
     } else {
@@ -246,18 +438,18 @@ static void declaration();
 static ParseRule* getRule(TokenType type);
 static void parsePrecedence(Precedence precedence);
 
-static uint8_t identifierConstant(Token* name) {
-  return makeConstant(OBJ_VAL(copyString(name->start,
-                                         name->length)));
+// Names are interned, so they can be compared by pointer and outlive
+// the scanner's copy of their tokens.
+static ObjString* identifierString(Token* name) {
+  return copyString(name->start, name->length);
 }
-static bool identifiersEqual(Token* a, Token* b) {
-  if (a->length != b->length) return false;
-  return memcmp(a->start, b->start, a->length) == 0;
+static uint8_t identifierConstant(Token* name) {
+  return makeConstant(OBJ_VAL(identifierString(name)));
 }
-static int resolveLocal(Compiler* compiler, Token* name) {
+static int resolveLocal(Compiler* compiler, ObjString* name) {
   for (int i = compiler->localCount - 1; i >= 0; i--) {
     Local* local = &compiler->locals[i];
-    if (identifiersEqual(name, &local->name)) {
+    if (local->name == name) {
       if (local->depth == -1) {
         error("Can't read local variable in its own initializer.");
       }
@@ -287,7 +479,7 @@ static int addUpvalue(Compiler* compiler, uint8_t index,
   compiler->upvalues[upvalueCount].index = index;
   return compiler->function->upvalueCount++;
 }
-static int resolveUpvalue(Compiler* compiler, Token* name) {
+static int resolveUpvalue(Compiler* compiler, ObjString* name) {
   if (compiler->enclosing == NULL) return -1;
 
   int local = resolveLocal(compiler->enclosing, name);
@@ -303,33 +495,46 @@ static int resolveUpvalue(Compiler* compiler, Token* name) {
   
   return -1;
 }
-static void addLocal(Token name) {
+static void addLocal(ObjString* name) {
   if (current->localCount == UINT8_COUNT) {
     error("Too many local variables in function.");
     return;
   }
 
-  Local* local = &current->locals[current->localCount++];
-  local->name = name;
+  Local* local = pushLocal(name);
   local->depth = -1;
   local->isCaptured = false;
+  local->escapes = false;
+  local->closureOffset = -1;
+}
+// Calls to pure natives are folded using the definitions in vm.globals,
+// so a script may not bind those names to anything else.
+static void checkNotPure(ObjString* name) {
+  Value value;
+  if (tableGet(&vm.globals, name, &value) && IS_NATIVE(value) &&
+      ((ObjNative*)AS_OBJ(value))->isPure) {
+    error("Can't redefine a pure native function.");
+  }
 }
 static void declareVariable() {
-  if (current->scopeDepth == 0) return;
+  ObjString* name = identifierString(&parser.previous);
+  if (current->scopeDepth == 0) {
+    checkNotPure(name);
+    return;
+  }
 
-  Token* name = &parser.previous;
   for (int i = current->localCount - 1; i >= 0; i--) {
     Local* local = &current->locals[i];
     if (local->depth != -1 && local->depth < current->scopeDepth) {
       break; // [negative]
     }
     
-    if (identifiersEqual(name, &local->name)) {
+    if (name == local->name) {
       error("Already a variable with this name in this scope.");
     }
   }
 
-  addLocal(*name);
+  addLocal(name);
 }
 static uint8_t parseVariable(const char* errorMessage) {
   consume(TOKEN_IDENTIFIER, errorMessage);
@@ -352,11 +557,36 @@ static void defineVariable(uint8_t global) {
 
   emitBytes(OP_DEFINE_GLOBAL, global);
 }
-static uint8_t argumentList() {
+static bool emittedConstant(int start, Value* value) {
+  Chunk* chunk = currentChunk();
+  if (chunk->count - start == 2 && chunk->code[start] == OP_CONSTANT) {
+    *value = chunk->constants.values[chunk->code[start + 1]];
+    return true;
+  }
+  if (chunk->count - start == 1) {
+    switch (chunk->code[start]) {
+      case OP_NIL: *value = NIL_VAL; return true;
+      case OP_TRUE: *value = BOOL_VAL(true); return true;
+      case OP_FALSE: *value = BOOL_VAL(false); return true;
+    }
+  }
+  return false;
+}
+#define FOLD_MAX_ARGS 4
+
+// If constants is not NULL, the first FOLD_MAX_ARGS arguments which
+// compile to a single constant are stored there, and *allConstant is
+// cleared for any other argument.
+static uint8_t argumentList(Value* constants, bool* allConstant) {
   uint8_t argCount = 0;
   if (!check(TOKEN_RIGHT_PAREN)) {
     do {
+      int start = currentChunk()->count;
       expression();
+      if (constants != NULL && (argCount >= FOLD_MAX_ARGS ||
+          !emittedConstant(start, &constants[argCount]))) {
+        *allConstant = false;
+      }
       if (argCount == 255) {
         error("Can't have more than 255 arguments.");
       }
@@ -393,8 +623,50 @@ static void binary(bool canAssign) {
     default: return; // Unreachable.
   }
 }
+// Replaces a call to a pure native, with all of its arguments constant,
+// by the result of calling it now. The native is looked up in the
+// globals as they are at compile time.
+static bool foldPureCall(int callee, int argCount, Value* args) {
+  if (!vm.foldPureCalls) return false;
+
+  Chunk* chunk = currentChunk();
+  ObjString* name = AS_STRING(
+      chunk->constants.values[chunk->code[callee + 1]]);
+  Value value;
+  if (!tableGet(&vm.globals, name, &value) || !IS_NATIVE(value)) {
+    return false;
+  }
+
+  ObjNative* native = (ObjNative*)AS_OBJ(value);
+  if (!native->isPure || native->arity != argCount) return false;
+  for (int i = 0; i < argCount; i++) {
+    if (!IS_NUMBER(args[i])) return false;
+  }
+
+  Value result = native->function(argCount, args);
+  if (result == ERR_VAL || IS_OBJ(result)) return false;
+
+  // Everything the call added to the constant table, from the native's
+  // name onwards, is no longer referenced.
+  chunk->constants.count = chunk->code[callee + 1];
+  chunk->count = callee;
+  current->lastGlobalGet = -1;
+  emitConstant(result);
+  return true;
+}
 static void call(bool canAssign) {
-  uint8_t argCount = argumentList();
+  int callee = -1;
+  if (current->lastGlobalGet == currentChunk()->count - 2) {
+    callee = current->lastGlobalGet;
+  }
+
+  Value args[FOLD_MAX_ARGS];
+  bool allConstant = true;
+  uint8_t argCount = argumentList(args, &allConstant);
+  if (callee != -1 && allConstant && !parser.hadError &&
+      foldPureCall(callee, argCount, args)) {
+    return;
+  }
   emitBytes(OP_CALL, argCount);
 }
 static void dot(bool canAssign) {
@@ -405,7 +677,7 @@ static void dot(bool canAssign) {
     expression();
     emitBytes(OP_SET_PROPERTY, name);
   } else if (match(TOKEN_LEFT_PAREN)) {
-    uint8_t argCount = argumentList();
+    uint8_t argCount = argumentList(NULL, NULL);
     emitBytes(OP_INVOKE, name);
     emitByte(argCount);
   } else {
@@ -425,7 +697,8 @@ static void grouping(bool canAssign) {
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 static void number(bool canAssign) {
-  double value = strtod(parser.previous.start, NULL);
+  double value = parseNumber(parser.previous.start,
+                             parser.previous.length);
   emitConstant(NUMBER_VAL(value));
 }
 static void or_(bool canAssign) {
@@ -442,36 +715,39 @@ static void string(bool canAssign) {
   emitConstant(OBJ_VAL(copyString(parser.previous.start + 1,
                                   parser.previous.length - 2)));
 }
-static void namedVariable(Token name, bool canAssign) {
+static void namedVariable(ObjString* name, bool canAssign) {
   uint8_t getOp, setOp;
-  int arg = resolveLocal(current, &name);
+  int arg = resolveLocal(current, name);
   if (arg != -1) {
     getOp = OP_GET_LOCAL;
     setOp = OP_SET_LOCAL;
-  } else if ((arg = resolveUpvalue(current, &name)) != -1) {
+    if (!check(TOKEN_LEFT_PAREN)) {
+      current->locals[arg].escapes = true;
+    }
+  } else if ((arg = resolveUpvalue(current, name)) != -1) {
     getOp = OP_GET_UPVALUE;
     setOp = OP_SET_UPVALUE;
   } else {
-    arg = identifierConstant(&name);
+    arg = makeConstant(OBJ_VAL(name));
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
   }
 
+  if (canAssign && check(TOKEN_EQUAL) && setOp == OP_SET_GLOBAL) {
+    checkNotPure(name);
+  }
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
     emitBytes(setOp, (uint8_t)arg);
   } else {
     emitBytes(getOp, (uint8_t)arg);
+    if (getOp == OP_GET_GLOBAL) {
+      current->lastGlobalGet = currentChunk()->count - 2;
+    }
   }
 }
 static void variable(bool canAssign) {
-  namedVariable(parser.previous, canAssign);
-}
-static Token syntheticToken(const char* text) {
-  Token token;
-  token.start = text;
-  token.length = (int)strlen(text);
-  return token;
+  namedVariable(identifierString(&parser.previous), canAssign);
 }
 static void super_(bool canAssign) {
   if (currentClass == NULL) {
@@ -484,14 +760,14 @@ static void super_(bool canAssign) {
   consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
   uint8_t name = identifierConstant(&parser.previous);
   
-  namedVariable(syntheticToken("this"), false);
+  namedVariable(copyString("this", 4), false);
   if (match(TOKEN_LEFT_PAREN)) {
-    uint8_t argCount = argumentList();
-    namedVariable(syntheticToken("super"), false);
+    uint8_t argCount = argumentList(NULL, NULL);
+    namedVariable(copyString("super", 5), false);
     emitBytes(OP_SUPER_INVOKE, name);
     emitByte(argCount);
   } else {
-    namedVariable(syntheticToken("super"), false);
+    namedVariable(copyString("super", 5), false);
     emitBytes(OP_GET_SUPER, name);
   }
 }
@@ -631,8 +907,8 @@ static void block() {
   consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 static void function(FunctionType type) {
-  Compiler compiler;
-  initCompiler(&compiler, type);
+  ArenaMark mark = arenaMark();
+  Compiler* compiler = newCompiler(type);
   beginScope(); // [no-end-scope]
 
   consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
@@ -651,12 +927,20 @@ static void function(FunctionType type) {
   block();
 
   ObjFunction* function = endCompiler();
-  emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
 
-  for (int i = 0; i < function->upvalueCount; i++) {
-    emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-    emitByte(compiler.upvalues[i].index);
+  // The upvalues are copied out of the body's share of the arena, so the
+  // share can be released before the closure instruction grows the
+  // enclosing chunk into it.
+  int upvalueCount = function->upvalueCount;
+  uint8_t operands[2 * upvalueCount + 1];
+  for (int i = 0; i < upvalueCount; i++) {
+    operands[2 * i] = compiler->upvalues[i].isLocal ? 1 : 0;
+    operands[2 * i + 1] = compiler->upvalues[i].index;
   }
+  arenaRelease(mark);
+
+  emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+  for (int i = 0; i < 2 * upvalueCount; i++) emitByte(operands[i]);
 }
 static void method() {
   consume(TOKEN_IDENTIFIER, "Expect method name.");
@@ -673,8 +957,8 @@ static void method() {
 }
 static void classDeclaration() {
   consume(TOKEN_IDENTIFIER, "Expect class name.");
-  Token className = parser.previous;
-  uint8_t nameConstant = identifierConstant(&parser.previous);
+  ObjString* className = identifierString(&parser.previous);
+  uint8_t nameConstant = makeConstant(OBJ_VAL(className));
   declareVariable();
 
   emitBytes(OP_CLASS, nameConstant);
@@ -689,12 +973,12 @@ static void classDeclaration() {
     consume(TOKEN_IDENTIFIER, "Expect superclass name.");
     variable(false);
 
-    if (identifiersEqual(&className, &parser.previous)) {
+    if (identifierString(&parser.previous) == className) {
       error("A class can't inherit from itself.");
     }
 
     beginScope();
-    addLocal(syntheticToken("super"));
+    addLocal(copyString("super", 5));
     defineVariable(0);
     
     namedVariable(className, false);
@@ -719,7 +1003,11 @@ static void classDeclaration() {
 static void funDeclaration() {
   uint8_t global = parseVariable("Expect function name.");
   markInitialized();
+  int closureOffset = currentChunk()->count;
   function(TYPE_FUNCTION);
+  if (current->scopeDepth > 0) {
+    current->locals[current->localCount - 1].closureOffset = closureOffset;
+  }
   defineVariable(global);
 }
 static void varDeclaration() {
@@ -893,10 +1181,8 @@ static void statement() {
   }
 }
 
-ObjFunction* compile(const char* source) {
-  initScanner(source);
-  Compiler compiler;
-  initCompiler(&compiler, TYPE_SCRIPT);
+static ObjFunction* compileScanned() {
+  newCompiler(TYPE_SCRIPT);
 
   parser.hadError = false;
   parser.panicMode = false;
@@ -908,12 +1194,48 @@ ObjFunction* compile(const char* source) {
   }
 
   ObjFunction* function = endCompiler();
+  arenaRelease((ArenaMark){NULL, 0});
   return parser.hadError ? NULL : function;
 }
+ObjFunction* compile(const char* source) {
+  initScanner(source);
+  return compileScanned();
+}
+// Compiles source as it is read, so that it never has to be held in
+// memory whole.
+ObjFunction* compileStream(SourceReader reader, void* context) {
+  initScannerReader(reader, context);
+  return compileScanned();
+}
+// Forgets a compilation cut short by running out of memory. The code of
+// functions still being compiled is in the arena, unless finishChunk()
+// had already copied it out, and is dropped before the arena is freed.
+void abandonCompile() {
+  for (Compiler* compiler = current; compiler != NULL;
+       compiler = compiler->enclosing) {
+    Chunk* chunk = &compiler->function->chunk;
+    if (!isInArena(chunk->code)) {
+      FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    }
+    FREE_ARRAY(uint8_t, chunk->lines, chunk->linesLength);
+    chunk->code = NULL;
+    chunk->lines = NULL;
+    chunk->linesLength = 0;
+    chunk->count = 0;
+    chunk->capacity = 0;
+  }
+  arenaRelease((ArenaMark){NULL, 0});
+
+  current = NULL;
+  currentClass = NULL;
+}
 void markCompilerRoots() {
   Compiler* compiler = current;
   while (compiler != NULL) {
     markObject((Obj*)compiler->function);
+    for (int i = 0; i < compiler->localCount; i++) {
+      markObject((Obj*)compiler->locals[i].name);
+    }
     compiler = compiler->enclosing;
   }
 }
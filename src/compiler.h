@@ -2,9 +2,12 @@
 #define clox_compiler_h
 
 #include "object.h"
+#include "scanner.h"
 #include "vm.h"
 
 ObjFunction* compile(const char* source);
+ObjFunction* compileStream(SourceReader reader, void* context);
 void markCompilerRoots();
+void abandonCompile();
 
 #endif
@@ -0,0 +1,387 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dtoa.h"
+
+// Numbers are printed with the fewest digits which read back as the
+// same double, using Florian Loitsch's Grisu2 algorithm. It works in
+// 64-bit integers scaled by a cached power of ten, which is much
+// cheaper than the arbitrary precision arithmetic of printf("%g") on
+// newlib, and it very rarely gives more digits than the shortest.
+
+// A floating point number f * 2^e with a 64-bit significand.
+typedef struct {
+  uint64_t f;
+  int e;
+} DiyFp;
+
+#define SIGNIFICAND_BITS 52
+#define HIDDEN_BIT ((uint64_t)1 << SIGNIFICAND_BITS)
+#define SIGNIFICAND_MASK (HIDDEN_BIT - 1)
+#define EXPONENT_BIAS (0x3ff + SIGNIFICAND_BITS)
+
+// 10^k for k = -348, -340, ..., 340, rounded to 64 bits.
+static const uint64_t powerSignificands[] = {
+  0xfa8fd5a0081c0288ull, 0xbaaee17fa23ebf76ull, 0x8b16fb203055ac76ull,
+  0xcf42894a5dce35eaull, 0x9a6bb0aa55653b2dull, 0xe61acf033d1a45dfull,
+  0xab70fe17c79ac6caull, 0xff77b1fcbebcdc4full, 0xbe5691ef416bd60cull,
+  0x8dd01fad907ffc3cull, 0xd3515c2831559a83ull, 0x9d71ac8fada6c9b5ull,
+  0xea9c227723ee8bcbull, 0xaecc49914078536dull, 0x823c12795db6ce57ull,
+  0xc21094364dfb5637ull, 0x9096ea6f3848984full, 0xd77485cb25823ac7ull,
+  0xa086cfcd97bf97f4ull, 0xef340a98172aace5ull, 0xb23867fb2a35b28eull,
+  0x84c8d4dfd2c63f3bull, 0xc5dd44271ad3cdbaull, 0x936b9fcebb25c996ull,
+  0xdbac6c247d62a584ull, 0xa3ab66580d5fdaf6ull, 0xf3e2f893dec3f126ull,
+  0xb5b5ada8aaff80b8ull, 0x87625f056c7c4a8bull, 0xc9bcff6034c13053ull,
+  0x964e858c91ba2655ull, 0xdff9772470297ebdull, 0xa6dfbd9fb8e5b88full,
+  0xf8a95fcf88747d94ull, 0xb94470938fa89bcfull, 0x8a08f0f8bf0f156bull,
+  0xcdb02555653131b6ull, 0x993fe2c6d07b7facull, 0xe45c10c42a2b3b06ull,
+  0xaa242499697392d3ull, 0xfd87b5f28300ca0eull, 0xbce5086492111aebull,
+  0x8cbccc096f5088ccull, 0xd1b71758e219652cull, 0x9c40000000000000ull,
+  0xe8d4a51000000000ull, 0xad78ebc5ac620000ull, 0x813f3978f8940984ull,
+  0xc097ce7bc90715b3ull, 0x8f7e32ce7bea5c70ull, 0xd5d238a4abe98068ull,
+  0x9f4f2726179a2245ull, 0xed63a231d4c4fb27ull, 0xb0de65388cc8ada8ull,
+  0x83c7088e1aab65dbull, 0xc45d1df942711d9aull, 0x924d692ca61be758ull,
+  0xda01ee641a708deaull, 0xa26da3999aef774aull, 0xf209787bb47d6b85ull,
+  0xb454e4a179dd1877ull, 0x865b86925b9bc5c2ull, 0xc83553c5c8965d3dull,
+  0x952ab45cfa97a0b3ull, 0xde469fbd99a05fe3ull, 0xa59bc234db398c25ull,
+  0xf6c69a72a3989f5cull, 0xb7dcbf5354e9beceull, 0x88fcf317f22241e2ull,
+  0xcc20ce9bd35c78a5ull, 0x98165af37b2153dfull, 0xe2a0b5dc971f303aull,
+  0xa8d9d1535ce3b396ull, 0xfb9b7cd9a4a7443cull, 0xbb764c4ca7a44410ull,
+  0x8bab8eefb6409c1aull, 0xd01fef10a657842cull, 0x9b10a4e5e9913129ull,
+  0xe7109bfba19c0c9dull, 0xac2820d9623bf429ull, 0x80444b5e7aa7cf85ull,
+  0xbf21e44003acdd2dull, 0x8e679c2f5e44ff8full, 0xd433179d9c8cb841ull,
+  0x9e19db92b4e31ba9ull, 0xeb96bf6ebadf77d9ull, 0xaf87023b9bf0ee6bull
+};
+static const int16_t powerExponents[] = {
+  -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+  -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+  -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+  -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+  -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+  109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+  375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+  641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+  907, 933, 960, 986, 1013, 1039, 1066
+};
+
+static const uint64_t powersOfTen[] = {
+  1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull,
+  10000000ull, 100000000ull, 1000000000ull, 10000000000ull,
+  100000000000ull, 1000000000000ull, 10000000000000ull,
+  100000000000000ull, 1000000000000000ull, 10000000000000000ull,
+  100000000000000000ull, 1000000000000000000ull,
+  10000000000000000000ull
+};
+
+static DiyFp multiply(DiyFp x, DiyFp y) {
+  uint64_t a = x.f >> 32, b = x.f & 0xffffffff;
+  uint64_t c = y.f >> 32, d = y.f & 0xffffffff;
+  uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+  uint64_t middle = (bd >> 32) + (ad & 0xffffffff) + (bc & 0xffffffff);
+  middle += (uint64_t)1 << 31;
+  DiyFp result = {ac + (ad >> 32) + (bc >> 32) + (middle >> 32),
+                  x.e + y.e + 64};
+  return result;
+}
+static DiyFp normalize(DiyFp x) {
+  int shift = __builtin_clzll(x.f);
+  x.f <<= shift;
+  x.e -= shift;
+  return x;
+}
+// The points halfway to the neighbouring doubles, between which any
+// number reads back as value.
+static void boundaries(DiyFp value, DiyFp* lower, DiyFp* upper) {
+  DiyFp plus = {(value.f << 1) + 1, value.e - 1};
+  plus = normalize(plus);
+
+  DiyFp minus;
+  if (value.f == HIDDEN_BIT) {
+    minus.f = (value.f << 2) - 1;
+    minus.e = value.e - 2;
+  } else {
+    minus.f = (value.f << 1) - 1;
+    minus.e = value.e - 1;
+  }
+  minus.f <<= minus.e - plus.e;
+  minus.e = plus.e;
+
+  *lower = minus;
+  *upper = plus;
+}
+// A cached power of ten c = 10^-k which brings a number with binary
+// exponent e into the range the digits are generated in.
+static DiyFp cachedPower(int e, int* k) {
+  double estimate = (-61 - e) * 0.30102999566398114 + 347;
+  int power = (int)estimate;
+  if (estimate - power > 0.0) power++;
+
+  int index = (power >> 3) + 1;
+  *k = -(-348 + index * 8);
+  DiyFp result = {powerSignificands[index], powerExponents[index]};
+  return result;
+}
+// Moves the last digit towards the exact value while it stays within
+// the range that reads back as the same number.
+static void roundDigits(char* digits, int length, uint64_t delta,
+                        uint64_t rest, uint64_t tenKappa,
+                        uint64_t distance) {
+  while (rest < distance && delta - rest >= tenKappa &&
+         (rest + tenKappa < distance ||
+          distance - rest > rest + tenKappa - distance)) {
+    digits[length - 1]--;
+    rest += tenKappa;
+  }
+}
+static int countDigits(uint32_t n) {
+  int count = 1;
+  while (count < 10 && n >= powersOfTen[count]) count++;
+  return count;
+}
+static int generateDigits(DiyFp w, DiyFp upper, uint64_t delta,
+                          char* digits, int* k) {
+  DiyFp one = {(uint64_t)1 << -upper.e, upper.e};
+  uint64_t distance = upper.f - w.f;
+  uint32_t integral = (uint32_t)(upper.f >> -one.e);
+  uint64_t fraction = upper.f & (one.f - 1);
+  int kappa = countDigits(integral);
+  int length = 0;
+
+  while (kappa > 0) {
+    uint32_t divisor = (uint32_t)powersOfTen[kappa - 1];
+    uint32_t digit = integral / divisor;
+    integral %= divisor;
+    if (digit != 0 || length != 0) digits[length++] = (char)('0' + digit);
+    kappa--;
+
+    uint64_t rest = ((uint64_t)integral << -one.e) + fraction;
+    if (rest <= delta) {
+      *k += kappa;
+      roundDigits(digits, length, delta, rest,
+                  powersOfTen[kappa] << -one.e, distance);
+      return length;
+    }
+  }
+
+  for (;;) {
+    fraction *= 10;
+    delta *= 10;
+    char digit = (char)(fraction >> -one.e);
+    if (digit != 0 || length != 0) digits[length++] = (char)('0' + digit);
+    fraction &= one.f - 1;
+    kappa--;
+    if (fraction < delta) {
+      *k += kappa;
+      roundDigits(digits, length, delta, fraction, one.f,
+                  -kappa < 20 ? distance * powersOfTen[-kappa] : 0);
+      return length;
+    }
+  }
+}
+// Fills digits with the shortest digits of a positive finite double,
+// returning how many, and sets k so that it equals digits * 10^k.
+static int grisu2(double value, char* digits, int* k) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  int biasedExponent = (int)(bits >> SIGNIFICAND_BITS);
+  DiyFp v;
+  if (biasedExponent != 0) {
+    v.f = (bits & SIGNIFICAND_MASK) + HIDDEN_BIT;
+    v.e = biasedExponent - EXPONENT_BIAS;
+  } else {
+    v.f = bits & SIGNIFICAND_MASK;
+    v.e = 1 - EXPONENT_BIAS;
+  }
+
+  DiyFp lower, upper;
+  boundaries(v, &lower, &upper);
+  DiyFp power = cachedPower(upper.e, k);
+  DiyFp w = multiply(normalize(v), power);
+  upper = multiply(upper, power);
+  lower = multiply(lower, power);
+  lower.f++;
+  upper.f--;
+  return generateDigits(w, upper, upper.f - lower.f, digits, k);
+}
+
+static int writeExponent(char* buffer, int exponent) {
+  char* start = buffer;
+  *buffer++ = 'e';
+  if (exponent < 0) {
+    *buffer++ = '-';
+    exponent = -exponent;
+  } else {
+    *buffer++ = '+';
+  }
+  if (exponent >= 100) *buffer++ = (char)('0' + exponent / 100);
+  if (exponent >= 10) *buffer++ = (char)('0' + exponent / 10 % 10);
+  *buffer++ = (char)('0' + exponent % 10);
+  return (int)(buffer - start);
+}
+// Lays out digits * 10^k the way JavaScript does: plainly from 1e-6 up
+// to 1e21, and with an exponent outside that.
+static int layOutDigits(char* buffer, const char* digits, int length,
+                        int k) {
+  int point = length + k;
+  if (length <= point && point <= 21) {
+    memcpy(buffer, digits, length);
+    memset(buffer + length, '0', point - length);
+    return point;
+  } else if (0 < point && point <= 21) {
+    memcpy(buffer, digits, point);
+    buffer[point] = '.';
+    memcpy(buffer + point + 1, digits + point, length - point);
+    return length + 1;
+  } else if (-6 < point && point <= 0) {
+    buffer[0] = '0';
+    buffer[1] = '.';
+    memset(buffer + 2, '0', -point);
+    memcpy(buffer + 2 - point, digits, length);
+    return 2 - point + length;
+  }
+
+  int written = 1;
+  buffer[0] = digits[0];
+  if (length > 1) {
+    buffer[1] = '.';
+    memcpy(buffer + 2, digits + 1, length - 1);
+    written = length + 1;
+  }
+  return written + writeExponent(buffer + written, point - 1);
+}
+
+int formatNumber(double value, char* buffer) {
+  char* start = buffer;
+  if (value != value) {
+    memcpy(buffer, "nan", 4);
+    return 3;
+  }
+  if (value < 0 || (value == 0 && 1 / value < 0)) {
+    *buffer++ = '-';
+    value = -value;
+  }
+  if (value == 1.0 / 0.0) {
+    memcpy(buffer, "inf", 4);
+    return (int)(buffer - start) + 3;
+  }
+
+  // Whole numbers, which most are, are written with integer division.
+  if (value < 1e15 && value == (double)(uint64_t)value) {
+    uint64_t integer = (uint64_t)value;
+    char digits[16];
+    int length = 0;
+    do {
+      digits[length++] = (char)('0' + integer % 10);
+      integer /= 10;
+    } while (integer != 0);
+    while (length > 0) *buffer++ = digits[--length];
+    *buffer = '\0';
+    return (int)(buffer - start);
+  }
+
+  char digits[20];
+  int k = 0;
+  int length = grisu2(value, digits, &k);
+  buffer += layOutDigits(buffer, digits, length, k);
+  *buffer = '\0';
+  return (int)(buffer - start);
+}
+// Numbers are read back by the compiler and toNumber().
+static bool isDigitIn(char c, int base) {
+  switch (base) {
+    case 2:  return c == '0' || c == '1';
+    case 16: return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') ||
+                    (c >= 'A' && c <= 'F');
+    default: return c >= '0' && c <= '9';
+  }
+}
+static int countDigitsIn(const char* chars, int base) {
+  int count = 0;
+  while (isDigitIn(chars[count], base)) count++;
+  return count;
+}
+// The same grammar as the scanner: 0x or 0b and at least one digit, or
+// decimal digits with an optional fraction that has digits on both
+// sides of the point.
+int scanNumber(const char* chars) {
+  if (chars[0] == '0' && (chars[1] == 'x' || chars[1] == 'X' ||
+                          chars[1] == 'b' || chars[1] == 'B')) {
+    int base = chars[1] == 'x' || chars[1] == 'X' ? 16 : 2;
+    int digits = countDigitsIn(chars + 2, base);
+    if (digits > 0) return 2 + digits;
+  }
+
+  int length = countDigitsIn(chars, 10);
+  if (length > 0 && chars[length] == '.') {
+    int fraction = countDigitsIn(chars + length + 1, 10);
+    if (fraction > 0) length += 1 + fraction;
+  }
+  return length;
+}
+static int digitValue(char c) {
+  if (c >= 'a') return c - 'a' + 10;
+  if (c >= 'A') return c - 'A' + 10;
+  return c - '0';
+}
+// Only the leading bits which fit in 64 are kept. Any non-zero digit
+// past them sets the lowest bit, which is well below the 53 that are
+// kept when converting to double, so that the result is only rounded
+// once, by that conversion.
+static double parseRadix(const char* digits, int length, int base) {
+  int bitsPerDigit = base == 16 ? 4 : 1;
+  uint64_t integer = 0;
+  int exponent = 0;
+  bool sticky = false;
+  for (int i = 0; i < length; i++) {
+    int digit = digitValue(digits[i]);
+    if ((integer >> (64 - bitsPerDigit)) == 0) {
+      integer = (integer << bitsPerDigit) | digit;
+    } else {
+      exponent += bitsPerDigit;
+      if (digit != 0) sticky = true;
+    }
+  }
+
+  if (sticky) integer |= 1;
+  return ldexp((double)integer, exponent);
+}
+// Decimal literals with few enough digits are converted exactly by one
+// division of two exact doubles: the digits as an integer below 2^53,
+// and a power of ten below 10^23. The rare others go to strtod().
+double parseNumber(const char* start, int length) {
+  static const double powersOfTen[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12,
+    1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+
+  if (length > 2 && start[0] == '0') {
+    if (start[1] == 'x' || start[1] == 'X') {
+      return parseRadix(start + 2, length - 2, 16);
+    }
+    if (start[1] == 'b' || start[1] == 'B') {
+      return parseRadix(start + 2, length - 2, 2);
+    }
+  }
+
+  uint64_t mantissa = 0;
+  int digits = 0;
+  int decimals = -1;
+  for (int i = 0; i < length && digits <= 19; i++) {
+    if (start[i] == '.') {
+      decimals = 0;
+      continue;
+    }
+    mantissa = mantissa * 10 + (start[i] - '0');
+    digits++;
+    if (decimals >= 0) decimals++;
+  }
+
+  if (digits <= 19) {
+    if (decimals <= 0) return (double)mantissa;
+    if (mantissa <= (uint64_t)1 << 53 && decimals <= 22) {
+      return (double)mantissa / powersOfTen[decimals];
+    }
+  }
+  return strtod(start, NULL);
+}
@@ -0,0 +1,16 @@
+#ifndef clox_dtoa_h
+#define clox_dtoa_h
+
+#include "common.h"
+
+// Enough for any number formatNumber() writes, and its terminator.
+#define NUMBER_BUFFER_SIZE 32
+
+int formatNumber(double value, char* buffer);
+
+// The length of the number literal chars starts with, or 0 if there
+// isn't one, and the value of a literal of that length.
+int scanNumber(const char* chars);
+double parseNumber(const char* start, int length);
+
+#endif
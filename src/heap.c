@@ -0,0 +1,277 @@
+#include "clox_stdio.h"
+#include <string.h>
+
+#include "heap.h"
+
+// Free blocks are kept in lists indexed by the position of their size's
+// highest set bit (first level) and the next SL_INDEX_LOG2 bits below
+// it (second level). Bitmaps of the non-empty lists make finding a
+// large enough block two count-trailing-zeros operations.
+#define ALIGN_SIZE 8
+#define SL_INDEX_LOG2 4
+#define SL_INDEX_COUNT (1 << SL_INDEX_LOG2)
+#define FL_INDEX_SHIFT (SL_INDEX_LOG2 + 3)
+#define FL_INDEX_MAX 30
+#define FL_INDEX_COUNT (FL_INDEX_MAX - FL_INDEX_SHIFT + 1)
+#define SMALL_BLOCK_SIZE (1 << FL_INDEX_SHIFT)
+
+#define BLOCK_FREE 1
+
+typedef struct HeapBlock {
+  struct HeapBlock* previousPhysical;
+  size_t size;
+
+  // Only present while the block is free, otherwise the payload
+  // starts here.
+  struct HeapBlock* nextFree;
+  struct HeapBlock* previousFree;
+} HeapBlock;
+
+#define BLOCK_HEADER_SIZE offsetof(HeapBlock, nextFree)
+#define BLOCK_MIN_SIZE (sizeof(HeapBlock) - BLOCK_HEADER_SIZE)
+
+typedef struct {
+  uint32_t flBitmap;
+  uint32_t slBitmap[FL_INDEX_COUNT];
+  HeapBlock* blocks[FL_INDEX_COUNT][SL_INDEX_COUNT];
+  uint8_t* start;
+  size_t size;
+  size_t usedBytes;
+  unsigned long grownInPlace;
+  unsigned long moved;
+  unsigned long bytesCopied;
+} Heap;
+
+static Heap heap;
+
+static int highestBit(size_t size) {
+  return (int)(sizeof(unsigned long) * 8) - 1 -
+         __builtin_clzl((unsigned long)size);
+}
+static size_t blockSize(HeapBlock* block) {
+  return block->size & ~(size_t)BLOCK_FREE;
+}
+static bool isFree(HeapBlock* block) {
+  return (block->size & BLOCK_FREE) != 0;
+}
+static void* payload(HeapBlock* block) {
+  return (uint8_t*)block + BLOCK_HEADER_SIZE;
+}
+static HeapBlock* blockOf(void* pointer) {
+  return (HeapBlock*)((uint8_t*)pointer - BLOCK_HEADER_SIZE);
+}
+static HeapBlock* nextPhysical(HeapBlock* block) {
+  return (HeapBlock*)((uint8_t*)payload(block) + blockSize(block));
+}
+static size_t adjustSize(size_t size) {
+  if (size < BLOCK_MIN_SIZE) size = BLOCK_MIN_SIZE;
+  return (size + ALIGN_SIZE - 1) & ~(size_t)(ALIGN_SIZE - 1);
+}
+static void mapping(size_t size, int* fl, int* sl) {
+  if (size < SMALL_BLOCK_SIZE) {
+    *fl = 0;
+    *sl = (int)size / (SMALL_BLOCK_SIZE / SL_INDEX_COUNT);
+  } else {
+    int bit = highestBit(size);
+    *sl = (int)(size >> (bit - SL_INDEX_LOG2)) ^ SL_INDEX_COUNT;
+    *fl = bit - (FL_INDEX_SHIFT - 1);
+  }
+}
+static void insertFree(HeapBlock* block) {
+  int fl, sl;
+  mapping(blockSize(block), &fl, &sl);
+  block->size |= BLOCK_FREE;
+  block->previousFree = NULL;
+  block->nextFree = heap.blocks[fl][sl];
+  if (block->nextFree != NULL) block->nextFree->previousFree = block;
+  heap.blocks[fl][sl] = block;
+  heap.flBitmap |= 1u << fl;
+  heap.slBitmap[fl] |= 1u << sl;
+}
+static void removeFree(HeapBlock* block) {
+  int fl, sl;
+  mapping(blockSize(block), &fl, &sl);
+  if (block->previousFree != NULL) {
+    block->previousFree->nextFree = block->nextFree;
+  } else {
+    heap.blocks[fl][sl] = block->nextFree;
+  }
+  if (block->nextFree != NULL) {
+    block->nextFree->previousFree = block->previousFree;
+  }
+
+  if (heap.blocks[fl][sl] == NULL) {
+    heap.slBitmap[fl] &= ~(1u << sl);
+    if (heap.slBitmap[fl] == 0) heap.flBitmap &= ~(1u << fl);
+  }
+  block->size &= ~(size_t)BLOCK_FREE;
+}
+static HeapBlock* findFree(size_t size) {
+  // Round up to the next list boundary so that any block in the list
+  // found is large enough.
+  if (size >= SMALL_BLOCK_SIZE) {
+    size += ((size_t)1 << (highestBit(size) - SL_INDEX_LOG2)) - 1;
+  }
+
+  int fl, sl;
+  mapping(size, &fl, &sl);
+  if (fl >= FL_INDEX_COUNT) return NULL;
+
+  uint32_t slMap = heap.slBitmap[fl] & (~0u << sl);
+  if (slMap == 0) {
+    uint32_t flMap = fl + 1 < 32 ? heap.flBitmap & (~0u << (fl + 1)) : 0;
+    if (flMap == 0) return NULL;
+    fl = __builtin_ctz(flMap);
+    slMap = heap.slBitmap[fl];
+  }
+  sl = __builtin_ctz(slMap);
+  return heap.blocks[fl][sl];
+}
+static HeapBlock* merge(HeapBlock* block, HeapBlock* next) {
+  block->size = blockSize(block) + BLOCK_HEADER_SIZE + blockSize(next);
+  nextPhysical(block)->previousPhysical = block;
+  return block;
+}
+// Gives the space beyond size back to the free lists, if there is
+// enough of it to make a block.
+static void trim(HeapBlock* block, size_t size) {
+  if (blockSize(block) < size + BLOCK_HEADER_SIZE + BLOCK_MIN_SIZE) return;
+
+  HeapBlock* rest = (HeapBlock*)((uint8_t*)payload(block) + size);
+  rest->size = blockSize(block) - size - BLOCK_HEADER_SIZE;
+  rest->previousPhysical = block;
+  block->size = size;
+
+  HeapBlock* next = nextPhysical(rest);
+  next->previousPhysical = rest;
+  if (isFree(next)) {
+    removeFree(next);
+    merge(rest, next);
+  }
+  insertFree(rest);
+}
+void initHeap(void* start, size_t size) {
+  memset(&heap, 0, sizeof(heap));
+
+  uintptr_t first = ((uintptr_t)start + ALIGN_SIZE - 1) &
+                    ~(uintptr_t)(ALIGN_SIZE - 1);
+  size -= first - (uintptr_t)start;
+  size &= ~(size_t)(ALIGN_SIZE - 1);
+  heap.start = (uint8_t*)first;
+  heap.size = size;
+
+  // One free block spanning the region, followed by an empty used
+  // block so that nextPhysical() never runs off the end.
+  HeapBlock* block = (HeapBlock*)heap.start;
+  block->previousPhysical = NULL;
+  block->size = size - 2 * BLOCK_HEADER_SIZE;
+
+  HeapBlock* sentinel = nextPhysical(block);
+  sentinel->previousPhysical = block;
+  sentinel->size = 0;
+
+  insertFree(block);
+}
+void* heapAllocate(size_t size) {
+  size = adjustSize(size);
+  HeapBlock* block = findFree(size);
+  if (block == NULL) return NULL;
+
+  removeFree(block);
+  trim(block, size);
+  heap.usedBytes += blockSize(block);
+  return payload(block);
+}
+void heapFree(void* pointer) {
+  if (pointer == NULL) return;
+
+  HeapBlock* block = blockOf(pointer);
+  heap.usedBytes -= blockSize(block);
+
+  HeapBlock* next = nextPhysical(block);
+  if (isFree(next)) {
+    removeFree(next);
+    merge(block, next);
+  }
+
+  HeapBlock* previous = block->previousPhysical;
+  if (previous != NULL && isFree(previous)) {
+    removeFree(previous);
+    block = merge(previous, block);
+  }
+
+  insertFree(block);
+}
+void* heapReallocate(void* pointer, size_t newSize) {
+  if (pointer == NULL) return heapAllocate(newSize);
+  if (newSize == 0) {
+    heapFree(pointer);
+    return NULL;
+  }
+
+  HeapBlock* block = blockOf(pointer);
+  size_t oldSize = blockSize(block);
+  size_t size = adjustSize(newSize);
+
+  if (size > oldSize) {
+    HeapBlock* next = nextPhysical(block);
+    if (!isFree(next) ||
+        oldSize + BLOCK_HEADER_SIZE + blockSize(next) < size) {
+      void* result = heapAllocate(newSize);
+      if (result == NULL) return NULL;
+
+      memcpy(result, pointer, oldSize);
+      heapFree(pointer);
+      heap.moved++;
+      heap.bytesCopied += oldSize;
+      return result;
+    }
+
+    removeFree(next);
+    merge(block, next);
+    heap.grownInPlace++;
+  }
+
+  trim(block, size);
+  heap.usedBytes += blockSize(block) - oldSize;
+  return pointer;
+}
+void heapInfo(HeapInfo* info) {
+  memset(info, 0, sizeof(HeapInfo));
+  info->totalBytes = heap.size;
+  info->grownInPlace = heap.grownInPlace;
+  info->moved = heap.moved;
+  info->bytesCopied = heap.bytesCopied;
+
+  for (HeapBlock* block = (HeapBlock*)heap.start;
+       blockSize(block) != 0;
+       block = nextPhysical(block)) {
+    if (isFree(block)) {
+      info->freeBlocks++;
+      info->freeBytes += blockSize(block);
+      if (blockSize(block) > info->largestFree) {
+        info->largestFree = blockSize(block);
+      }
+    } else {
+      info->usedBlocks++;
+      info->usedBytes += blockSize(block);
+    }
+  }
+}
+void printHeapInfo() {
+  HeapInfo info;
+  heapInfo(&info);
+
+  // Fragmentation is the share of free memory that is not part of the
+  // largest free block, so 0% means all of it is available at once.
+  int fragmentation = info.freeBytes == 0 ? 0 :
+      (int)(100 - info.largestFree * 100 / info.freeBytes);
+  printf("heap: %lu of %lu bytes used in %d blocks\n",
+         (unsigned long)info.usedBytes, (unsigned long)info.totalBytes,
+         info.usedBlocks);
+  printf("free: %lu bytes in %d blocks, largest %lu, %d%% fragmented\n",
+         (unsigned long)info.freeBytes, info.freeBlocks,
+         (unsigned long)info.largestFree, fragmentation);
+  printf("grown in place %lu, moved %lu (%lu bytes copied)\n",
+         info.grownInPlace, info.moved, info.bytesCopied);
+}
@@ -0,0 +1,30 @@
+#ifndef clox_heap_h
+#define clox_heap_h
+
+#include "common.h"
+
+// A two-level segregated fit (TLSF) allocator over a single region of
+// memory, used by the sketch to manage SDRAM. Free blocks are merged
+// with their neighbors as soon as they are freed, and a block being
+// grown takes over a free block directly after it instead of moving.
+
+typedef struct {
+  size_t totalBytes;
+  size_t usedBytes;
+  size_t freeBytes;
+  size_t largestFree;
+  int usedBlocks;
+  int freeBlocks;
+  unsigned long grownInPlace;
+  unsigned long moved;
+  unsigned long bytesCopied;
+} HeapInfo;
+
+void initHeap(void* start, size_t size);
+void* heapAllocate(size_t size);
+void* heapReallocate(void* pointer, size_t newSize);
+void heapFree(void* pointer);
+void heapInfo(HeapInfo* info);
+void printHeapInfo();
+
+#endif
@@ -0,0 +1,216 @@
+#include "clox_stdio.h"
+#include <string.h>
+
+#include "chunk.h"
+#include "image.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+typedef enum {
+  CONST_NUMBER,
+  CONST_STRING,
+  CONST_FUNCTION,
+  CONST_NIL,
+  CONST_TRUE,
+  CONST_FALSE
+} ConstantTag;
+
+typedef struct {
+  int column;
+} Writer;
+
+static void writeByte(Writer* writer, uint8_t byte) {
+  if (writer->column == 0) printf("  ");
+  printf("0x%02x,", byte);
+  if (++writer->column == 16) {
+    printf("\n");
+    writer->column = 0;
+  }
+}
+static void writeUint(Writer* writer, uint32_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    writeByte(writer, (value >> (8 * i)) & 0xff);
+  }
+}
+static void writeChars(Writer* writer, const char* chars, int length) {
+  writeUint(writer, length, 4);
+  for (int i = 0; i < length; i++) writeByte(writer, chars[i]);
+}
+static void writeNumber(Writer* writer, double number) {
+  uint64_t bits;
+  memcpy(&bits, &number, sizeof(bits));
+  writeUint(writer, (uint32_t)bits, 4);
+  writeUint(writer, (uint32_t)(bits >> 32), 4);
+}
+static void writeFunction(Writer* writer, ObjFunction* function) {
+  writeByte(writer, function->arity);
+  writeByte(writer, function->upvalueCount);
+  writeByte(writer, function->usesEnclosingFrame);
+  writeByte(writer, function->name != NULL);
+  if (function->name != NULL) {
+    writeChars(writer, function->name->chars, function->name->length);
+  }
+
+  Chunk* chunk = &function->chunk;
+  writeUint(writer, chunk->count, 4);
+  for (int i = 0; i < chunk->count; i++) {
+    writeByte(writer, chunk->code[i]);
+  }
+  writeUint(writer, chunk->linesLength, 4);
+  for (int i = 0; i < chunk->linesLength; i++) {
+    writeByte(writer, chunk->lines[i]);
+  }
+
+  writeUint(writer, chunk->constants.count, 2);
+  for (int i = 0; i < chunk->constants.count; i++) {
+    Value value = chunk->constants.values[i];
+    if (IS_NUMBER(value)) {
+      writeByte(writer, CONST_NUMBER);
+      writeNumber(writer, AS_NUMBER(value));
+    } else if (IS_STRING(value)) {
+      writeByte(writer, CONST_STRING);
+      writeChars(writer, AS_STRING(value)->chars,
+                 AS_STRING(value)->length);
+    } else if (IS_FUNCTION(value)) {
+      writeByte(writer, CONST_FUNCTION);
+      writeFunction(writer, AS_FUNCTION(value));
+    } else if (IS_BOOL(value)) {
+      writeByte(writer, AS_BOOL(value) ? CONST_TRUE : CONST_FALSE);
+    } else {
+      writeByte(writer, CONST_NIL);
+    }
+  }
+}
+void dumpImage(ObjFunction* function, const char* name) {
+  Writer writer;
+  writer.column = 0;
+
+  printf("const uint8_t %s[] = {\n", name);
+  for (int i = 0; i < 4; i++) writeByte(&writer, IMAGE_MAGIC[i]);
+  writeByte(&writer, IMAGE_VERSION);
+  writeFunction(&writer, function);
+  if (writer.column != 0) printf("\n");
+  printf("};\n");
+}
+
+typedef struct {
+  const uint8_t* current;
+#ifdef CLOX_COMPILED_CODE
+  // The compiled code for each function, in the order they are read.
+  const CompiledCode* compiled;
+#endif
+} Reader;
+
+static uint32_t readUint(Reader* reader, int bytes) {
+  uint32_t value = 0;
+  for (int i = 0; i < bytes; i++) {
+    value |= (uint32_t)*reader->current++ << (8 * i);
+  }
+  return value;
+}
+static double readNumber(Reader* reader) {
+  uint64_t bits = readUint(reader, 4);
+  bits |= (uint64_t)readUint(reader, 4) << 32;
+  double number;
+  memcpy(&number, &bits, sizeof(number));
+  return number;
+}
+static ObjString* readString(Reader* reader) {
+  int length = readUint(reader, 4);
+  ObjString* string = copyString((const char*)reader->current, length);
+  reader->current += length;
+  return string;
+}
+static void addFunctionConstant(ObjFunction* function, Value value) {
+  addConstant(&function->chunk, value);
+  WRITE_BARRIER(function, value);
+}
+static ObjFunction* readFunction(Reader* reader) {
+  // The function is kept on the stack until its caller has stored it,
+  // since every string and nested function read below can trigger GC.
+  ObjFunction* function = newFunction();
+  push(OBJ_VAL(function));
+#ifdef CLOX_COMPILED_CODE
+  if (reader->compiled != NULL) function->compiled = *reader->compiled++;
+#endif
+  function->arity = readUint(reader, 1);
+  function->upvalueCount = readUint(reader, 1);
+  function->usesEnclosingFrame = readUint(reader, 1);
+  if (readUint(reader, 1)) {
+#ifdef CLOX_STRIP_DEBUG_INFO
+    int length = readUint(reader, 4);
+    reader->current += length;
+#else
+    function->name = readString(reader);
+    WRITE_BARRIER(function, OBJ_VAL(function->name));
+#endif
+  }
+
+  Chunk* chunk = &function->chunk;
+  int count = readUint(reader, 4);
+  chunk->code = ALLOCATE(uint8_t, count);
+  chunk->capacity = count;
+  memcpy(chunk->code, reader->current, count);
+  reader->current += count;
+  chunk->count = count;
+
+  int linesLength = readUint(reader, 4);
+#ifndef CLOX_STRIP_DEBUG_INFO
+  chunk->lines = ALLOCATE(uint8_t, linesLength);
+  chunk->linesLength = linesLength;
+  memcpy(chunk->lines, reader->current, linesLength);
+#endif
+  reader->current += linesLength;
+
+  int constantCount = readUint(reader, 2);
+  for (int i = 0; i < constantCount; i++) {
+    switch (readUint(reader, 1)) {
+      case CONST_NUMBER:
+        addFunctionConstant(function, NUMBER_VAL(readNumber(reader)));
+        break;
+      case CONST_STRING:
+        addFunctionConstant(function, OBJ_VAL(readString(reader)));
+        break;
+      case CONST_FUNCTION:
+        addFunctionConstant(function, OBJ_VAL(readFunction(reader)));
+        pop();
+        break;
+      case CONST_TRUE:
+        addFunctionConstant(function, BOOL_VAL(true));
+        break;
+      case CONST_FALSE:
+        addFunctionConstant(function, BOOL_VAL(false));
+        break;
+      default:
+        addFunctionConstant(function, NIL_VAL);
+        break;
+    }
+  }
+  return function;
+}
+static ObjFunction* readImage(Reader* reader, const uint8_t* image) {
+  if (memcmp(image, IMAGE_MAGIC, 4) != 0 || image[4] != IMAGE_VERSION) {
+    return NULL;
+  }
+
+  reader->current = image + 5;
+  ObjFunction* function = readFunction(reader);
+  pop();
+  return function;
+}
+ObjFunction* loadImage(const uint8_t* image) {
+  Reader reader;
+#ifdef CLOX_COMPILED_CODE
+  reader.compiled = NULL;
+#endif
+  return readImage(&reader, image);
+}
+#ifdef CLOX_COMPILED_CODE
+ObjFunction* loadCompiledImage(const uint8_t* image,
+                               const CompiledCode* compiled) {
+  Reader reader;
+  reader.compiled = compiled;
+  return readImage(&reader, image);
+}
+#endif
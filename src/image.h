@@ -0,0 +1,22 @@
+#ifndef clox_image_h
+#define clox_image_h
+
+#include "object.h"
+
+// A bytecode image is the output of compile() flattened into a byte
+// array, so that scripts which never change can be linked into the
+// sketch as C source and run without scanning or compiling them again.
+
+#define IMAGE_MAGIC "LOXI"
+#define IMAGE_VERSION 3
+
+void dumpImage(ObjFunction* function, const char* name);
+ObjFunction* loadImage(const uint8_t* image);
+#ifdef CLOX_COMPILED_CODE
+// Loads an image along with the C functions extras/lox2c translated
+// its functions into, one for each function in the image.
+ObjFunction* loadCompiledImage(const uint8_t* image,
+                               const CompiledCode* compiled);
+#endif
+
+#endif
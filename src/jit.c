@@ -0,0 +1,449 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "jit.h"
+#include "vm.h"
+
+#ifdef CLOX_JIT
+
+#if !defined(__x86_64__) || !(defined(__unix__) || defined(__APPLE__))
+#error "CLOX_JIT generates x86-64 code for Unix hosts."
+#endif
+#ifndef NAN_BOXING
+#error "CLOX_JIT needs NAN_BOXING."
+#endif
+
+#include <sys/mman.h>
+
+// A compiled function is entered through its CompiledCode with the
+// frame to run, and starts at the instruction frame->ip points to, so
+// it can be resumed after anything left to the interpreter. It returns
+// when it reaches such an instruction, with frame->ip pointing at it.
+// While it runs these registers, which calls preserve, hold:
+//
+//   rbx  vm.stackTop
+//   r12  frame->slots
+//   r13  frame
+//   r14  QNAN, so nil, true and false are each a lea away
+//
+// r15 is only saved to keep the stack aligned for calls.
+//
+// Code is generated into a buffer on the C heap and only copied to
+// executable memory when complete, so it only refers to itself relative
+// to the instruction pointer.
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+       R8, R9, R10, R11, R12, R13, R14, R15 };
+
+typedef struct {
+  int at;     // Offset of a rel32 to fill in.
+  int target; // Bytecode offset it jumps to.
+} Patch;
+
+typedef struct {
+  uint8_t* code;
+  int count;
+  int capacity;
+
+  Chunk* chunk;
+  // Where the machine code for each instruction starts.
+  int* starts;
+  // Jumps between instructions, and to the code leaving each
+  // instruction to the interpreter.
+  Patch* jumps;
+  int jumpCount;
+  Patch* exits;
+  int exitCount;
+  int patchCapacity;
+} Assembler;
+
+// The machine code is preceded by its size, for jitFree().
+#define HEADER_SIZE 16
+
+static void emitCode(Assembler* as, const uint8_t* bytes, int count) {
+  if (as->count + count > as->capacity) {
+    as->capacity = as->capacity < 256 ? 256 : as->capacity * 2;
+    as->code = realloc(as->code, as->capacity);
+    if (as->code == NULL) exit(1);
+  }
+  memcpy(as->code + as->count, bytes, count);
+  as->count += count;
+}
+
+#define EMIT(as, ...) \
+    emitCode(as, (const uint8_t[]){__VA_ARGS__}, \
+             sizeof((const uint8_t[]){__VA_ARGS__}))
+
+static void emit32(Assembler* as, uint32_t value) {
+  emitCode(as, (const uint8_t*)&value, 4);
+}
+static void emit64(Assembler* as, uint64_t value) {
+  emitCode(as, (const uint8_t*)&value, 8);
+}
+static void patch32(Assembler* as, int at, int32_t value) {
+  memcpy(as->code + at, &value, 4);
+}
+// Makes the rel32 at at jump to the code at target.
+static void patchJump(Assembler* as, int at, int target) {
+  patch32(as, at, target - (at + 4));
+}
+
+static uint8_t rex(int reg, int base) {
+  return 0x48 | (reg >= R8 ? 0x04 : 0) | (base >= R8 ? 0x01 : 0);
+}
+// op reg, [base + disp] for the mov (0x8b) and store (0x89) opcodes.
+static void emitMemory(Assembler* as, uint8_t opcode, int reg, int base,
+                       int32_t disp) {
+  EMIT(as, rex(reg, base), opcode,
+       0x80 | (reg & 7) << 3 | (base & 7));
+  if ((base & 7) == RSP) EMIT(as, 0x24);
+  emit32(as, disp);
+}
+// mov reg, [base + disp]
+static void load(Assembler* as, int reg, int base, int32_t disp) {
+  emitMemory(as, 0x8b, reg, base, disp);
+}
+// mov [base + disp], reg
+static void store(Assembler* as, int base, int32_t disp, int reg) {
+  emitMemory(as, 0x89, reg, base, disp);
+}
+// mov reg, imm64
+static void loadImmediate(Assembler* as, int reg, uint64_t value) {
+  EMIT(as, 0x48 | (reg >= R8 ? 0x01 : 0), 0xb8 + (reg & 7));
+  emit64(as, value);
+}
+// op dst, src for mov (0x89), add (0x01), sub (0x29), and (0x21) and
+// cmp (0x39).
+static void emitRegisters(Assembler* as, uint8_t opcode, int dst,
+                          int src) {
+  EMIT(as, rex(src, dst), opcode, 0xc0 | (src & 7) << 3 | (dst & 7));
+}
+// add reg, imm8 or sub reg, -imm8
+static void addImmediate(Assembler* as, int reg, int8_t value) {
+  EMIT(as, 0x48 | (reg >= R8 ? 0x01 : 0), 0x83,
+       (value < 0 ? 0xe8 : 0xc0) | (reg & 7),
+       (uint8_t)(value < 0 ? -value : value));
+}
+// lea reg, [r14 + tag], the Value with that tag.
+static void loadTag(Assembler* as, int reg, int tag) {
+  EMIT(as, rex(reg, R14), 0x8d, 0x40 | (reg & 7) << 3 | (R14 & 7),
+       (uint8_t)tag);
+}
+static void call(Assembler* as, void* function) {
+  loadImmediate(as, RAX, (uint64_t)(uintptr_t)function);
+  EMIT(as, 0xff, 0xd0); // call rax
+}
+
+static void addPatch(Assembler* as, Patch** patches, int* count,
+                     int target) {
+  if (as->jumpCount + as->exitCount + 1 > as->patchCapacity) {
+    as->patchCapacity = as->patchCapacity < 64 ? 64
+                                               : as->patchCapacity * 2;
+    as->jumps = realloc(as->jumps, sizeof(Patch) * as->patchCapacity);
+    as->exits = realloc(as->exits, sizeof(Patch) * as->patchCapacity);
+    if (as->jumps == NULL || as->exits == NULL) exit(1);
+  }
+  Patch* patch = &(*patches)[(*count)++];
+  patch->at = as->count;
+  patch->target = target;
+}
+// jmp (or jcc if condition isn't zero) to the instruction at target.
+static void jumpTo(Assembler* as, uint8_t condition, int target) {
+  if (condition == 0) {
+    EMIT(as, 0xe9);
+  } else {
+    EMIT(as, 0x0f, condition);
+  }
+  addPatch(as, &as->jumps, &as->jumpCount, target);
+  emit32(as, 0);
+}
+#define JE 0x84
+
+// Leaves the instruction at offset to the interpreter if the condition
+// holds, through a stub at the end of the code.
+static void exitIf(Assembler* as, uint8_t condition, int offset) {
+  EMIT(as, 0x0f, condition);
+  addPatch(as, &as->exits, &as->exitCount, offset);
+  emit32(as, 0);
+}
+// Leaves the instruction at offset to the interpreter, by returning
+// with frame->ip pointing at it.
+static void exitAt(Assembler* as, int offset, int epilogue) {
+  loadImmediate(as, RAX, (uint64_t)(uintptr_t)(as->chunk->code + offset));
+  EMIT(as, 0xe9);
+  emit32(as, epilogue - (as->count + 4));
+}
+// Exits unless the Value in reg is a number, using rdx.
+static void checkNumber(Assembler* as, int reg, int offset) {
+  emitRegisters(as, 0x89, RDX, reg);
+  emitRegisters(as, 0x21, RDX, R14);
+  emitRegisters(as, 0x39, RDX, R14);
+  exitIf(as, JE, offset);
+}
+// Loads the two operands of a binary operator into rax and rcx, or
+// exits if either isn't a number.
+static void loadNumbers(Assembler* as, int offset) {
+  load(as, RAX, RBX, -16);
+  checkNumber(as, RAX, offset);
+  load(as, RCX, RBX, -8);
+  checkNumber(as, RCX, offset);
+}
+static void pushRegister(Assembler* as, int reg) {
+  store(as, RBX, 0, reg);
+  addImmediate(as, RBX, 8);
+}
+// Replaces the two operands with the result in rax.
+static void replaceOperands(Assembler* as) {
+  store(as, RBX, -16, RAX);
+  addImmediate(as, RBX, -8);
+}
+// Turns the flag in dl into a Value in rax.
+static void boolFromDl(Assembler* as) {
+  EMIT(as, 0x0f, 0xb6, 0xd2); // movzx edx, dl
+  loadTag(as, RAX, TAG_FALSE);
+  emitRegisters(as, 0x01, RAX, RDX);
+}
+
+static void arithmetic(Assembler* as, uint8_t sse, int offset) {
+  loadNumbers(as, offset);
+  EMIT(as, 0x66, 0x48, 0x0f, 0x6e, 0xc0); // movq xmm0, rax
+  EMIT(as, 0x66, 0x48, 0x0f, 0x6e, 0xc9); // movq xmm1, rcx
+  EMIT(as, 0xf2, 0x0f, sse, 0xc1);        // op xmm0, xmm1
+  EMIT(as, 0x66, 0x48, 0x0f, 0x7e, 0xc0); // movq rax, xmm0
+  replaceOperands(as);
+}
+static void comparison(Assembler* as, bool isLess, int offset) {
+  loadNumbers(as, offset);
+  EMIT(as, 0x66, 0x48, 0x0f, 0x6e, 0xc0); // movq xmm0, rax
+  EMIT(as, 0x66, 0x48, 0x0f, 0x6e, 0xc9); // movq xmm1, rcx
+  // ucomisd xmm1, xmm0 for a < b or ucomisd xmm0, xmm1 for a > b, then
+  // seta dl, which is false if either is NaN.
+  EMIT(as, 0x66, 0x0f, 0x2e, isLess ? 0xc8 : 0xc1);
+  EMIT(as, 0x0f, 0x97, 0xc2);
+  boolFromDl(as);
+  replaceOperands(as);
+}
+// Jumps to target if the Value in rax is falsey, using rcx.
+static void jumpIfFalsey(Assembler* as, int target) {
+  loadTag(as, RCX, TAG_NIL);
+  emitRegisters(as, 0x39, RAX, RCX);
+  jumpTo(as, JE, target);
+  loadTag(as, RCX, TAG_FALSE);
+  emitRegisters(as, 0x39, RAX, RCX);
+  jumpTo(as, JE, target);
+}
+
+static void prologue(Assembler* as, int* tablePatch, int* basePatch) {
+  EMIT(as, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57);
+  emitRegisters(as, 0x89, R13, RDI);
+  loadImmediate(as, RAX, (uint64_t)(uintptr_t)&vm.stackTop);
+  load(as, RBX, RAX, 0);
+  load(as, R12, R13, offsetof(CallFrame, slots));
+  loadImmediate(as, R14, QNAN);
+
+  // Jump to the code for the instruction at frame->ip.
+  load(as, RAX, R13, offsetof(CallFrame, ip));
+  loadImmediate(as, RCX, (uint64_t)(uintptr_t)as->chunk->code);
+  emitRegisters(as, 0x29, RAX, RCX);
+  EMIT(as, 0x48, 0x8d, 0x0d); // lea rcx, [rip + starts table]
+  *tablePatch = as->count;
+  emit32(as, 0);
+  EMIT(as, 0x8b, 0x04, 0x81); // mov eax, [rcx + rax * 4]
+  EMIT(as, 0x48, 0x8d, 0x0d); // lea rcx, [rip + start of code]
+  *basePatch = as->count;
+  emit32(as, 0);
+  emitRegisters(as, 0x01, RAX, RCX);
+  EMIT(as, 0xff, 0xe0); // jmp rax
+}
+// Returns with frame->ip set to rax.
+static void epilogue(Assembler* as) {
+  store(as, R13, offsetof(CallFrame, ip), RAX);
+  loadImmediate(as, RCX, (uint64_t)(uintptr_t)&vm.stackTop);
+  store(as, RCX, 0, RBX);
+  EMIT(as, 0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0xc3);
+}
+
+static void compileInstruction(Assembler* as, int offset, int exit) {
+  Chunk* chunk = as->chunk;
+  uint8_t* code = chunk->code;
+#define OPERAND() (code[offset + 1])
+#define JUMP_TARGET(sign) \
+    (offset + 3 + (sign) * ((code[offset + 1] << 8) | code[offset + 2]))
+
+  switch (code[offset]) {
+    case OP_CONSTANT:
+      loadImmediate(as, RAX, chunk->constants.values[OPERAND()]);
+      pushRegister(as, RAX);
+      break;
+    case OP_NIL:   loadTag(as, RAX, TAG_NIL); pushRegister(as, RAX); break;
+    case OP_TRUE:  loadTag(as, RAX, TAG_TRUE); pushRegister(as, RAX); break;
+    case OP_FALSE: loadTag(as, RAX, TAG_FALSE); pushRegister(as, RAX); break;
+    case OP_POP:   addImmediate(as, RBX, -8); break;
+    case OP_GET_LOCAL:
+      load(as, RAX, R12, OPERAND() * sizeof(Value));
+      pushRegister(as, RAX);
+      break;
+    case OP_SET_LOCAL:
+      load(as, RAX, RBX, -8);
+      store(as, R12, OPERAND() * sizeof(Value), RAX);
+      break;
+    case OP_GET_GLOBAL: {
+      // An undefined variable is left for the interpreter to report.
+      ObjString* name = AS_STRING(chunk->constants.values[OPERAND()]);
+      loadImmediate(as, RDI, (uint64_t)(uintptr_t)&vm.globals);
+      loadImmediate(as, RSI, (uint64_t)(uintptr_t)name);
+      emitRegisters(as, 0x89, RDX, RBX);
+      call(as, (void*)tableGet);
+      EMIT(as, 0x84, 0xc0); // test al, al
+      exitIf(as, JE, offset);
+      addImmediate(as, RBX, 8);
+      break;
+    }
+    case OP_GET_UPVALUE:
+      load(as, RAX, R13, offsetof(CallFrame, closure));
+      load(as, RAX, RAX,
+           offsetof(ObjClosure, upvalues) + OPERAND() * sizeof(ObjUpvalue*));
+      load(as, RAX, RAX, offsetof(ObjUpvalue, location));
+      load(as, RAX, RAX, 0);
+      pushRegister(as, RAX);
+      break;
+    case OP_GET_ENCLOSING:
+      load(as, RAX, R13,
+           (int32_t)offsetof(CallFrame, slots) - (int32_t)sizeof(CallFrame));
+      load(as, RAX, RAX, OPERAND() * sizeof(Value));
+      pushRegister(as, RAX);
+      break;
+    case OP_SET_ENCLOSING:
+      load(as, RCX, R13,
+           (int32_t)offsetof(CallFrame, slots) - (int32_t)sizeof(CallFrame));
+      load(as, RAX, RBX, -8);
+      store(as, RCX, OPERAND() * sizeof(Value), RAX);
+      break;
+    case OP_EQUAL:
+      load(as, RDI, RBX, -16);
+      load(as, RSI, RBX, -8);
+      call(as, (void*)valuesEqual);
+      EMIT(as, 0x0f, 0xb6, 0xd0); // movzx edx, al
+      boolFromDl(as);
+      replaceOperands(as);
+      break;
+    case OP_GREATER:  comparison(as, false, offset); break;
+    case OP_LESS:     comparison(as, true, offset); break;
+    // Strings and lists are added by the interpreter.
+    case OP_ADD:      arithmetic(as, 0x58, offset); break;
+    case OP_SUBTRACT: arithmetic(as, 0x5c, offset); break;
+    case OP_MULTIPLY: arithmetic(as, 0x59, offset); break;
+    case OP_DIVIDE:   arithmetic(as, 0x5e, offset); break;
+    case OP_NOT:
+      load(as, RAX, RBX, -8);
+      loadTag(as, RCX, TAG_NIL);
+      emitRegisters(as, 0x39, RAX, RCX);
+      EMIT(as, 0x0f, 0x94, 0xc2); // sete dl
+      loadTag(as, RCX, TAG_FALSE);
+      emitRegisters(as, 0x39, RAX, RCX);
+      EMIT(as, 0x0f, 0x94, 0xc1); // sete cl
+      EMIT(as, 0x08, 0xca);       // or dl, cl
+      boolFromDl(as);
+      store(as, RBX, -8, RAX);
+      break;
+    case OP_NEGATE:
+      load(as, RAX, RBX, -8);
+      checkNumber(as, RAX, offset);
+      EMIT(as, 0x48, 0x0f, 0xba, 0xf8, 0x3f); // btc rax, 63
+      store(as, RBX, -8, RAX);
+      break;
+    case OP_JUMP:
+      jumpTo(as, 0, JUMP_TARGET(1));
+      break;
+    case OP_JUMP_IF_FALSE:
+      load(as, RAX, RBX, -8);
+      jumpIfFalsey(as, JUMP_TARGET(1));
+      break;
+    case OP_LOOP:
+      jumpTo(as, 0, JUMP_TARGET(-1));
+      break;
+    default:
+      exitAt(as, offset, exit);
+      break;
+  }
+
+#undef OPERAND
+#undef JUMP_TARGET
+}
+
+static void freeAssembler(Assembler* as) {
+  free(as->code);
+  free(as->starts);
+  free(as->jumps);
+  free(as->exits);
+}
+
+void jitCompile(ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  Assembler as = {0};
+  as.chunk = chunk;
+  as.starts = calloc(chunk->count, sizeof(int));
+  if (as.starts == NULL) return;
+
+  int tablePatch, basePatch;
+  prologue(&as, &tablePatch, &basePatch);
+  int exit = as.count;
+  epilogue(&as);
+
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    as.starts[offset] = as.count;
+    compileInstruction(&as, offset, exit);
+  }
+
+  for (int i = 0; i < as.jumpCount; i++) {
+    patchJump(&as, as.jumps[i].at, as.starts[as.jumps[i].target]);
+  }
+  // Exits from the same instruction share a stub.
+  int lastStub = -1;
+  int lastOffset = -1;
+  for (int i = 0; i < as.exitCount; i++) {
+    if (as.exits[i].target != lastOffset) {
+      lastOffset = as.exits[i].target;
+      lastStub = as.count;
+      exitAt(&as, lastOffset, exit);
+    }
+    patchJump(&as, as.exits[i].at, lastStub);
+  }
+  patchJump(&as, basePatch, 0);
+
+  while (as.count % 4 != 0) EMIT(&as, 0xcc);
+  patchJump(&as, tablePatch, as.count);
+  for (int offset = 0; offset < chunk->count; offset++) {
+    emit32(&as, as.starts[offset]);
+  }
+
+  size_t size = HEADER_SIZE + as.count;
+  uint8_t* memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory != MAP_FAILED) {
+    memcpy(memory, &size, sizeof(size));
+    memcpy(memory + HEADER_SIZE, as.code, as.count);
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) == 0) {
+      function->compiled = (CompiledCode)(void*)(memory + HEADER_SIZE);
+    } else {
+      munmap(memory, size);
+    }
+  }
+  freeAssembler(&as);
+}
+void jitFree(ObjFunction* function) {
+  // Code compiled ahead of time isn't the JIT's to free.
+  if (function->compiled == NULL || function->hotness < JIT_THRESHOLD) {
+    return;
+  }
+
+  uint8_t* memory = (uint8_t*)(void*)function->compiled - HEADER_SIZE;
+  size_t size;
+  memcpy(&size, memory, sizeof(size));
+  munmap(memory, size);
+  function->compiled = NULL;
+}
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "object.h"
+
+// Host builds for x86-64 can compile the bytecode of functions that are
+// run often to machine code, by defining CLOX_JIT. The machine code
+// runs the instructions that are simple and common, such as arithmetic,
+// locals and jumps, and leaves the rest to run() one at a time.
+
+#ifdef CLOX_JIT
+
+// Calls and loop iterations before a function is compiled.
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 100
+#endif
+
+void jitCompile(ObjFunction* function);
+void jitFree(ObjFunction* function);
+
+#endif
+
+#endif
@@ -1,15 +1,31 @@
+#include "clox_stdio.h"
+#include "clox_gfx.h"
 #include <stdlib.h>
+#include <string.h>
+
+#ifdef CLOX_PARALLEL_GC
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
 
 #include "compiler.h"
+#include "jit.h"
 #include "memory.h"
 #include "vm.h"
 
 #ifdef DEBUG_LOG_GC
-#include "clox_stdio.h"
 #include "debug.h"
 #endif
 
-#define GC_HEAP_GROW_FACTOR 2
+// Bytes allocated between the steps of an incremental collection, and
+// the number of objects traced or swept between checks of the time.
+#define GC_STEP_SIZE (16 * 1024)
+#define GC_STEP_OBJECTS 32
+
+// Room past vm.heapLimit given after running out of memory, enough to
+// compile and run a short script.
+#define HEAP_RESERVE (32 * 1024)
 
 #if 0
 // define this in sketch to use SDRAM
@@ -23,6 +39,7 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
     if (vm.bytesAllocated > vm.nextGC) {
       collectGarbage();
     }
+    checkHeapLimit(oldSize, newSize);
   }
 
   if (newSize == 0) {
@@ -31,22 +48,561 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
   }
 
   void* result = realloc(pointer, newSize);
-  if (result == NULL) exit(1);
+  if (result == NULL) {
+    reclaimMemory();
+    result = realloc(pointer, newSize);
+    if (result == NULL) outOfMemory(oldSize, newSize);
+  }
   return result;
 }
 #endif
-void markObject(Obj* object) {
-  if (object == NULL) return;
-  if (object->isMarked) return;
 
-#ifdef DEBUG_LOG_GC
-  printf("%p mark ", (void*)object);
-  printValue(OBJ_VAL(object));
-  printf("\n");
+// Called by reallocate() when growing a block would take the heap past
+// vm.heapLimit, or the allocator has failed even after collecting all
+// garbage. The allocation is abandoned by raising a runtime error which
+// unwinds the script, back to where the VM was entered.
+void outOfMemory(size_t oldSize, size_t newSize) {
+  vm.bytesAllocated -= newSize - oldSize;
+  if (vm.outOfMemory == NULL) {
+    printf("Fatal Error: Out of memory.");
+    exit(1);
+  }
+
+  // What the script kept alive may fill the heap, so the next one is
+  // given some room past the limit to be compiled in and free it.
+  if (vm.heapLimit != 0) {
+    vm.heapReserve = vm.bytesAllocated + HEAP_RESERVE - vm.heapLimit;
+  }
+
+  runtimeError("Out of memory.");
+  longjmp(*vm.outOfMemory, 1);
+}
+// Frees everything that can be before giving up on an allocation. The
+// string table may have grown large for strings which have since been
+// collected, so it is shrunk as well.
+void reclaimMemory() {
+  collectAllGarbage();
+  tableShrink(&vm.strings);
+}
+void checkHeapLimit(size_t oldSize, size_t newSize) {
+  size_t limit = vm.heapLimit + vm.heapReserve;
+  if (vm.heapLimit == 0 || vm.bytesAllocated <= limit) return;
+
+  reclaimMemory();
+  if (vm.bytesAllocated > vm.heapLimit + vm.heapReserve) {
+    outOfMemory(oldSize, newSize);
+  }
+}
+
+// Small blocks come from size-class pools instead of reallocate() so
+// that the objects the VM churns through don't fragment the heap.
+// Arenas of pages are carved out of reallocate(); each page serves a
+// single size class and is found from any block in it by masking the
+// address, which makes freeing O(1). A page whose blocks are all free
+// goes back to a shared list and may be reused for another class.
+//
+// Objects and arrays get separate pages. Object pages record which of
+// their blocks are in use, and are swept by walking those bitmaps, so
+// pooled objects are not on the vm.objects lists at all. Pages where
+// objects have been allocated since the last minor collection are kept
+// on the nursery list, as those are the only ones it needs to sweep.
+//
+// The nursery is these pages rather than one region allocated by
+// bumping a pointer and emptied by copying out the survivors. Natives,
+// the compiler and the VM itself hold Obj pointers in C locals across
+// allocations, where a copying collector couldn't update them, so
+// objects never move. Within a fresh page, blocks are still handed out
+// by bumping page->unused.
+#define POOL_CLASS_COUNT 8
+#define POOL_MAX_SIZE (POOL_GRANULE * POOL_CLASS_COUNT)
+#define POOL_ARENA_PAGES 16
+#define POOL_ARENA_SIZE \
+    ((POOL_ARENA_PAGES + 1) * POOL_PAGE_SIZE + sizeof(ArenaTail))
+
+typedef struct PoolBlock {
+  struct PoolBlock* next;
+} PoolBlock;
+
+// Stored just past the last aligned page of each arena.
+typedef struct {
+  uint8_t* previous;
+} ArenaTail;
+
+static PoolPage* availablePages[2][POOL_CLASS_COUNT];
+static PoolPage* unsweptPages[POOL_CLASS_COUNT];
+static PoolPage* nurseryPages = NULL;
+static PoolPage* emptyPages = NULL;
+static uint8_t* arenas = NULL;
+
+static uint8_t* alignToPage(uint8_t* pointer) {
+  return (uint8_t*)(((uintptr_t)pointer + POOL_PAGE_SIZE - 1) &
+                    ~(uintptr_t)(POOL_PAGE_SIZE - 1));
+}
+static ArenaTail* arenaTail(uint8_t* arena) {
+  return (ArenaTail*)(alignToPage(arena) +
+                      POOL_ARENA_PAGES * POOL_PAGE_SIZE);
+}
+static void addArena() {
+  // Arenas are not heap growth as far as the collector is concerned.
+  // Only the blocks handed out of them count towards the next GC.
+  uint8_t* arena = (uint8_t*)reallocate(NULL, 0, POOL_ARENA_SIZE);
+  vm.bytesAllocated -= POOL_ARENA_SIZE;
+  arenaTail(arena)->previous = arenas;
+  arenas = arena;
+
+  uint8_t* first = alignToPage(arena);
+  for (int i = POOL_ARENA_PAGES - 1; i >= 0; i--) {
+    PoolPage* page = (PoolPage*)(first + i * POOL_PAGE_SIZE);
+    page->liveCount = 0;
+    page->isNursery = false;
+    page->next = emptyPages;
+    emptyPages = page;
+  }
+}
+static int sizeClassOf(PoolPage* page) {
+  return page->blockSize / POOL_GRANULE - 1;
+}
+static bool isFull(PoolPage* page) {
+  return page->freeBlocks == NULL &&
+      page->unused + page->blockSize > (uint8_t*)page + POOL_PAGE_SIZE;
+}
+static void setBit(uint32_t* bitmap, int index, bool value) {
+  if (value) {
+    bitmap[index / 32] |= 1u << (index % 32);
+  } else {
+    bitmap[index / 32] &= ~(1u << (index % 32));
+  }
+}
+static void unlinkPage(PoolPage* page) {
+  if (page->previous != NULL) {
+    page->previous->next = page->next;
+  } else {
+    availablePages[page->isObjects][sizeClassOf(page)] = page->next;
+  }
+  if (page->next != NULL) page->next->previous = page->previous;
+  page->isAvailable = false;
+}
+static void linkPage(PoolPage* page) {
+  PoolPage** list = &availablePages[page->isObjects][sizeClassOf(page)];
+  page->previous = NULL;
+  page->next = *list;
+  if (page->next != NULL) page->next->previous = page;
+  *list = page;
+  page->isAvailable = true;
+}
+static void sweepPage(PoolPage* page, bool isYoung);
+
+static void* allocateBlock(size_t size, bool isObject) {
+#ifdef DEBUG_STRESS_GC
+  collectGarbage();
 #endif
 
-  object->isMarked = true;
+  // Only counted once a page has been found, as adding an arena can
+  // fail.
+  if (vm.bytesAllocated + size > vm.nextGC) {
+    collectGarbage();
+  }
+
+  // Pages left to sweep by the current major collection are swept
+  // before new objects of their size are allocated from them.
+  int sizeClass = (int)((size - 1) / POOL_GRANULE);
+  PoolPage** available = &availablePages[isObject][sizeClass];
+  while (*available == NULL && isObject &&
+         unsweptPages[sizeClass] != NULL) {
+    PoolPage* unswept = unsweptPages[sizeClass];
+    unsweptPages[sizeClass] = unswept->next;
+    sweepPage(unswept, false);
+  }
+
+  PoolPage* page = *available;
+  if (page == NULL) {
+    if (emptyPages == NULL) addArena();
+    page = emptyPages;
+    emptyPages = page->next;
+
+    page->freeBlocks = NULL;
+    page->unused = (uint8_t*)page + POOL_HEADER_SIZE;
+    page->blockSize = (sizeClass + 1) * POOL_GRANULE;
+    page->reciprocal = (uint16_t)((65536 + page->blockSize - 1) /
+                                  page->blockSize);
+    page->liveCount = 0;
+    page->isObjects = isObject;
+    memset(page->allocated, 0, sizeof(page->allocated));
+    linkPage(page);
+  }
+
+  vm.bytesAllocated += size;
+  void* block;
+  if (page->freeBlocks != NULL) {
+    block = page->freeBlocks;
+    page->freeBlocks = page->freeBlocks->next;
+  } else {
+    block = page->unused;
+    page->unused += page->blockSize;
+  }
+  page->liveCount++;
+  if (isFull(page)) unlinkPage(page);
+
+  if (isObject) {
+    setBit(page->allocated, BLOCK_INDEX(page, block), true);
+    if (!page->isNursery) {
+      page->isNursery = true;
+      page->nextNursery = nurseryPages;
+      nurseryPages = page;
+    }
+  }
+
+  return block;
+}
+static void freeBlock(void* pointer, size_t size) {
+  vm.bytesAllocated -= size;
+
+  PoolPage* page = PAGE_OF(pointer);
+  if (page->isObjects) {
+    setBit(page->allocated, BLOCK_INDEX(page, pointer), false);
+  }
+
+  if (--page->liveCount == 0) {
+    if (page->isAvailable) unlinkPage(page);
+    page->next = emptyPages;
+    emptyPages = page;
+    return;
+  }
+
+  PoolBlock* block = (PoolBlock*)pointer;
+  block->next = page->freeBlocks;
+  page->freeBlocks = block;
+  if (!page->isAvailable) linkPage(page);
+}
+static bool isPooled(size_t size) {
+  return size > 0 && size <= POOL_MAX_SIZE;
+}
+void* reallocateBlock(void* pointer, size_t oldSize, size_t newSize) {
+  if (!isPooled(oldSize) && !isPooled(newSize)) {
+    return reallocate(pointer, oldSize, newSize);
+  }
+
+  if (isPooled(oldSize) && isPooled(newSize) &&
+      (oldSize - 1) / POOL_GRANULE == (newSize - 1) / POOL_GRANULE) {
+    vm.bytesAllocated += newSize - oldSize;
+    return pointer;
+  }
+
+  void* result = NULL;
+  if (isPooled(newSize)) {
+    result = allocateBlock(newSize, false);
+  } else if (newSize > 0) {
+    result = reallocate(NULL, 0, newSize);
+  }
+
+  if (oldSize > 0) {
+    if (result != NULL) {
+      memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+    }
+
+    if (isPooled(oldSize)) {
+      freeBlock(pointer, oldSize);
+    } else {
+      reallocate(pointer, oldSize, 0);
+    }
+  }
+
+  return result;
+}
+// Objects too large for the pools are kept on the young object list
+// instead, and swept by following it. The link is stored in front of
+// the object so that pooled ones don't need room for it.
+typedef union {
+  Obj* next;
+  double alignment;
+} ObjLink;
+
+#define NEXT_OBJ(object) (((ObjLink*)(object) - 1)->next)
+
+Obj* allocateObjectMemory(size_t size) {
+  if (isPooled(size)) {
+    Obj* object = (Obj*)allocateBlock(size, true);
+    object->isPooled = true;
+    return object;
+  }
+
+  ObjLink* link = (ObjLink*)reallocate(NULL, 0, sizeof(ObjLink) + size);
+  Obj* object = (Obj*)(link + 1);
+  object->isPooled = false;
+  NEXT_OBJ(object) = vm.objects;
+  vm.objects = object;
+  return object;
+}
+static void freeObjectMemory(Obj* object, size_t size) {
+  if (object->isPooled) {
+    freeBlock(object, size);
+  } else {
+    reallocate((ObjLink*)object - 1, sizeof(ObjLink) + size, 0);
+  }
+}
+static void freePools() {
+  while (arenas != NULL) {
+    uint8_t* arena = arenas;
+    arenas = arenaTail(arena)->previous;
+    reallocate(arena, POOL_ARENA_SIZE, 0);
+    vm.bytesAllocated += POOL_ARENA_SIZE;
+  }
+
+  memset(availablePages, 0, sizeof(availablePages));
+  memset(unsweptPages, 0, sizeof(unsweptPages));
+  nurseryPages = NULL;
+  emptyPages = NULL;
+}
+static void setMark(Obj* object, bool mark) {
+  if (object->isPooled) {
+    PoolPage* page = PAGE_OF(object);
+    setBit(page->marks, BLOCK_INDEX(page, object), mark);
+  } else {
+    object->mark = mark;
+  }
+}
+#ifdef CLOX_PARALLEL_GC
+// Marking on several threads. Each has a gray stack of its own, and
+// moves the older half of it to where other threads can steal it from
+// whenever what it shared before has been taken. A thread with nothing
+// left to trace steals, and marking is done once every thread is out
+// of work at the same time.
+//
+// Objects are claimed by setting their mark atomically, so each is
+// traced once. The VM is stopped throughout, so nothing else changes.
+
+// Objects traced by the VM's thread before the others are woken, which
+// most minor collections never reach, and the smallest gray stack half
+// of which is worth sharing.
+#define GC_PARALLEL_THRESHOLD 1024
+#define GC_SHARE_MIN 64
+
+typedef struct {
+  Obj** stack;
+  int count;
+  int capacity;
+
+  pthread_mutex_t lock;
+  Obj** shared;
+  int sharedCount;
+  int sharedCapacity;
+} GcWorker;
+
+static GcWorker workers[CLOX_PARALLEL_GC];
+static int workerCount = 0;
+static int threadsStarted = 1;
+
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolWake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t poolDone = PTHREAD_COND_INITIALIZER;
+static unsigned long traceCount = 0;
+static int busyThreads = 0;
+static int idleWorkers = 0;
+
+static __thread GcWorker* worker = NULL;
+
+static Obj** growStack(Obj** stack, int* capacity, int count) {
+  if (*capacity >= count) return stack;
+  while (*capacity < count) *capacity = GROW_CAPACITY(*capacity);
+  stack = (Obj**)realloc(stack, sizeof(Obj*) * *capacity);
+
+  if (stack == NULL) exit(1);
+  return stack;
+}
+// Sets the mark of an object, returning false if another thread got
+// there first.
+static bool claimObject(Obj* object) {
+  bool mark = vm.markEpoch;
+  if (!object->isPooled) {
+    if (__atomic_load_n(&object->mark, __ATOMIC_RELAXED) == mark) {
+      return false;
+    }
+    return __atomic_exchange_n(&object->mark, mark, __ATOMIC_RELAXED) !=
+           mark;
+  }
+
+  PoolPage* page = PAGE_OF(object);
+  int index = BLOCK_INDEX(page, object);
+  uint32_t* word = &page->marks[index / 32];
+  uint32_t bit = 1u << (index % 32);
+  uint32_t old = __atomic_load_n(word, __ATOMIC_RELAXED);
+  if (((old & bit) != 0) == mark) return false;
+
+  if (mark) return (__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) &
+                    bit) == 0;
+  return (__atomic_fetch_and(word, ~bit, __ATOMIC_RELAXED) & bit) != 0;
+}
+static void shareWork(GcWorker* self) {
+  if (self->count < GC_SHARE_MIN ||
+      __atomic_load_n(&self->sharedCount, __ATOMIC_RELAXED) != 0) {
+    return;
+  }
+
+  int half = self->count / 2;
+  pthread_mutex_lock(&self->lock);
+  self->shared = growStack(self->shared, &self->sharedCapacity, half);
+  memcpy(self->shared, self->stack, sizeof(Obj*) * half);
+  __atomic_store_n(&self->sharedCount, half, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&self->lock);
+
+  self->count -= half;
+  memmove(self->stack, self->stack + half, sizeof(Obj*) * self->count);
+}
+static bool takeWork(GcWorker* self, GcWorker* victim) {
+  if (__atomic_load_n(&victim->sharedCount, __ATOMIC_RELAXED) == 0) {
+    return false;
+  }
+
+  pthread_mutex_lock(&victim->lock);
+  int count = victim->sharedCount;
+  self->stack = growStack(self->stack, &self->capacity,
+                          self->count + count);
+  memcpy(self->stack + self->count, victim->shared, sizeof(Obj*) * count);
+  self->count += count;
+  __atomic_store_n(&victim->sharedCount, 0, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&victim->lock);
+  return count > 0;
+}
+// Takes back what this thread shared before trying the others.
+static bool stealWork(GcWorker* self) {
+  int index = (int)(self - workers);
+  for (int i = 0; i < workerCount; i++) {
+    if (takeWork(self, &workers[(index + i) % workerCount])) return true;
+  }
+  return false;
+}
+// Waits while out of work, returning false once every thread is. A
+// thread only goes idle with nothing shared, and idle threads share
+// nothing new, so there is no work left by then.
+static bool waitForWork(GcWorker* self) {
+  __atomic_add_fetch(&idleWorkers, 1, __ATOMIC_SEQ_CST);
+  for (;;) {
+    if (__atomic_load_n(&idleWorkers, __ATOMIC_SEQ_CST) == workerCount) {
+      return false;
+    }
+
+    for (int i = 0; i < workerCount; i++) {
+      if (__atomic_load_n(&workers[i].sharedCount,
+                          __ATOMIC_RELAXED) == 0) {
+        continue;
+      }
+
+      __atomic_sub_fetch(&idleWorkers, 1, __ATOMIC_SEQ_CST);
+      if (stealWork(self)) return true;
+      __atomic_add_fetch(&idleWorkers, 1, __ATOMIC_SEQ_CST);
+      break;
+    }
+    sched_yield();
+  }
+}
+static void blackenObject(Obj* object);
+
+static void traceShared(GcWorker* self) {
+  worker = self;
+  do {
+    while (self->count > 0) {
+      blackenObject(self->stack[--self->count]);
+      shareWork(self);
+    }
+  } while (stealWork(self) || waitForWork(self));
+  worker = NULL;
+}
+static void* workerThread(void* argument) {
+  GcWorker* self = (GcWorker*)argument;
+  unsigned long tracesSeen = 0;
+
+  pthread_mutex_lock(&poolLock);
+  for (;;) {
+    while (traceCount == tracesSeen) {
+      pthread_cond_wait(&poolWake, &poolLock);
+    }
+    tracesSeen = traceCount;
+    if (self - workers >= workerCount) continue;
+
+    pthread_mutex_unlock(&poolLock);
+    traceShared(self);
+    pthread_mutex_lock(&poolLock);
+    if (--busyThreads == 0) pthread_cond_signal(&poolDone);
+  }
+  return NULL;
+}
+static void startWorkers() {
+  if (workerCount == 0) {
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    workerCount = processors < 1 ? 1
+                : processors > CLOX_PARALLEL_GC ? CLOX_PARALLEL_GC
+                : (int)processors;
+    pthread_mutex_init(&workers[0].lock, NULL);
+  }
+
+  for (; threadsStarted < workerCount; threadsStarted++) {
+    GcWorker* thread = &workers[threadsStarted];
+    pthread_mutex_init(&thread->lock, NULL);
+    pthread_t id;
+    if (pthread_create(&id, NULL, workerThread, thread) != 0) {
+      workerCount = threadsStarted;
+      break;
+    }
+    pthread_detach(id);
+  }
+}
+// Traces from the gray stack on every thread, once there is enough to
+// be worth it. The VM's thread works on the gray stack in place.
+static bool traceInParallel() {
+  for (int i = 0; i < GC_PARALLEL_THRESHOLD; i++) {
+    if (vm.grayCount == 0) return true;
+    blackenObject(vm.grayStack[--vm.grayCount]);
+  }
+
+  startWorkers();
+  if (workerCount == 1) return false;
+
+  GcWorker* self = &workers[0];
+  self->stack = vm.grayStack;
+  self->count = vm.grayCount;
+  self->capacity = vm.grayCapacity;
+
+  pthread_mutex_lock(&poolLock);
+  idleWorkers = 0;
+  busyThreads = workerCount - 1;
+  traceCount++;
+  pthread_cond_broadcast(&poolWake);
+  pthread_mutex_unlock(&poolLock);
 
+  traceShared(self);
+
+  pthread_mutex_lock(&poolLock);
+  while (busyThreads > 0) pthread_cond_wait(&poolDone, &poolLock);
+  pthread_mutex_unlock(&poolLock);
+
+  vm.grayStack = self->stack;
+  vm.grayCount = 0;
+  vm.grayCapacity = self->capacity;
+  return true;
+}
+int setGcThreads(int count) {
+  startWorkers();
+  if (count >= 1 && count <= CLOX_PARALLEL_GC) {
+    workerCount = count;
+    startWorkers();
+  }
+  return workerCount;
+}
+static void freeWorkers() {
+  for (int i = 1; i < threadsStarted; i++) {
+    free(workers[i].stack);
+    free(workers[i].shared);
+    workers[i].stack = NULL;
+    workers[i].shared = NULL;
+    workers[i].capacity = 0;
+    workers[i].sharedCapacity = 0;
+  }
+  free(workers[0].shared);
+  workers[0].shared = NULL;
+  workers[0].sharedCapacity = 0;
+}
+#endif
+static void grayObject(Obj* object) {
   if (vm.grayCapacity < vm.grayCount + 1) {
     vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
     vm.grayStack = (Obj**)realloc(vm.grayStack,
@@ -57,9 +613,67 @@ void markObject(Obj* object) {
 
   vm.grayStack[vm.grayCount++] = object;
 }
+void markObject(Obj* object) {
+  if (object == NULL) return;
+#ifdef CLOX_PARALLEL_GC
+  if (worker != NULL) {
+    if (claimObject(object)) {
+      worker->stack = growStack(worker->stack, &worker->capacity,
+                                worker->count + 1);
+      worker->stack[worker->count++] = object;
+    }
+    return;
+  }
+#endif
+  if (IS_MARKED(object)) return;
+
+#ifdef DEBUG_LOG_GC
+  printf("%p mark ", (void*)object);
+  printValue(OBJ_VAL(object));
+  printf("\n");
+#endif
+
+  setMark(object, vm.markEpoch);
+  grayObject(object);
+}
 void markValue(Value value) {
   if (IS_OBJ(value)) markObject(AS_OBJ(value));
 }
+// Objects allocated while marking start gray, so that they survive the
+// cycle and whatever is stored in them while being initialized is
+// traced.
+void initMark(Obj* object) {
+  setMark(object, !vm.markEpoch);
+  if (vm.gcPhase == GC_MARK) {
+    setMark(object, vm.markEpoch);
+    grayObject(object);
+  }
+}
+static void rememberObject(Obj* object) {
+  object->isRemembered = true;
+
+  if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+    vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+    vm.rememberedSet = (Obj**)realloc(vm.rememberedSet,
+        sizeof(Obj*) * vm.rememberedCapacity);
+
+    if (vm.rememberedSet == NULL) exit(1);
+  }
+
+  vm.rememberedSet[vm.rememberedCount++] = object;
+}
+// A marked object is being given a reference to an unmarked one. While
+// marking, the owner may already have been traced, so the value is
+// marked now (keeping black objects from pointing to white ones).
+// Otherwise the owner is old and the value young, so the owner is
+// remembered for the next minor collection.
+void writeBarrier(Obj* owner, Obj* value) {
+  if (vm.gcPhase == GC_MARK) {
+    markObject(value);
+  } else if (!owner->isRemembered) {
+    rememberObject(owner);
+  }
+}
 static void markArray(ValueArray* array) {
   for (int i = 0; i < array->count; i++) {
     markValue(array->values[i]);
@@ -96,6 +710,7 @@ static void blackenObject(Obj* object) {
     case OBJ_FUNCTION: {
       ObjFunction* function = (ObjFunction*)object;
       markObject((Obj*)function->name);
+      markObject((Obj*)function->sharedClosure);
       markArray(&function->chunk.constants);
       break;
     }
@@ -108,8 +723,13 @@ static void blackenObject(Obj* object) {
     case OBJ_UPVALUE:
       markValue(((ObjUpvalue*)object)->closed);
       break;
-    case OBJ_NATIVE:
     case OBJ_STRING:
+      if (((ObjString*)object)->isSlice) {
+        markObject((Obj*)((ObjSlice*)object)->parent);
+      }
+      break;
+    case OBJ_NATIVE:
+    case OBJ_BUILDER:
       break;
     case OBJ_LIST: {
       ObjList* list = (ObjList*)object;
@@ -120,60 +740,106 @@ static void blackenObject(Obj* object) {
     }
   }
 }
+#define FREE_OBJ(type, object) freeObjectMemory(object, sizeof(type))
+
 static void freeObject(Obj* object) {
 #ifdef DEBUG_LOG_GC
   printf("%p free type %d\n", (void*)object, object->type);
 #endif
 
+  vm.gcStats.objectCounts[object->type]--;
+
   switch (object->type) {
     case OBJ_BOUND_METHOD:
-      FREE(ObjBoundMethod, object);
+      FREE_OBJ(ObjBoundMethod, object);
       break;
     case OBJ_CLASS: {
       ObjClass* klass = (ObjClass*)object;
       freeTable(&klass->methods);
-      FREE(ObjClass, object);
+      FREE_OBJ(ObjClass, object);
       break;
     } // [braces]
     case OBJ_CLOSURE: {
       ObjClosure* closure = (ObjClosure*)object;
-      FREE_ARRAY(ObjUpvalue*, closure->upvalues,
-                 closure->upvalueCount);
-      FREE(ObjClosure, object);
+      freeObjectMemory(object, FLEX_SIZE(ObjClosure, ObjUpvalue*,
+                                         closure->upvalueCount));
       break;
     }
     case OBJ_FUNCTION: {
       ObjFunction* function = (ObjFunction*)object;
+#ifdef CLOX_JIT
+      jitFree(function);
+#endif
       freeChunk(&function->chunk);
-      FREE(ObjFunction, object);
+      FREE_OBJ(ObjFunction, object);
       break;
     }
     case OBJ_INSTANCE: {
       ObjInstance* instance = (ObjInstance*)object;
       freeTable(&instance->fields);
-      FREE(ObjInstance, object);
+      FREE_OBJ(ObjInstance, object);
       break;
     }
     case OBJ_NATIVE:
-      FREE(ObjNative, object);
+      FREE_OBJ(ObjNative, object);
       break;
     case OBJ_STRING: {
       ObjString* string = (ObjString*)object;
-      FREE_ARRAY(char, string->chars, string->length + 1);
-      FREE(ObjString, object);
+      if (string->isSlice) {
+        FREE_OBJ(ObjSlice, object);
+      } else {
+        freeObjectMemory(object, FLEX_SIZE(ObjString, char,
+                                           string->length + 1));
+      }
       break;
     }
     case OBJ_LIST: {
       ObjList* list = (ObjList*)object;
-      FREE_ARRAY(Value*, list->items, list->count);
-      FREE(ObjList, object);
+      FREE_ARRAY(Value, list->items, list->capacity);
+      FREE_OBJ(ObjList, object);
+      break;
+    }
+    case OBJ_BUILDER: {
+      ObjBuilder* builder = (ObjBuilder*)object;
+      FREE_ARRAY(char, builder->chars, builder->capacity);
+      FREE_OBJ(ObjBuilder, object);
       break;
     }
     case OBJ_UPVALUE:
-      FREE(ObjUpvalue, object);
+      FREE_OBJ(ObjUpvalue, object);
       break;
   }
 }
+// Frees the unmarked objects on a page of them, using the bitmaps to
+// find them without touching the live ones, and makes the page
+// available again if it has room.
+static void sweepPage(PoolPage* page, bool isYoung) {
+  uint8_t* blocks = (uint8_t*)page + POOL_HEADER_SIZE;
+  for (int i = 0; i < POOL_BITMAP_WORDS; i++) {
+    uint32_t unmarked = vm.markEpoch ? ~page->marks[i] : page->marks[i];
+    uint32_t dead = page->allocated[i] & unmarked;
+    while (dead != 0) {
+      int index = i * 32 + __builtin_ctz(dead);
+      dead &= dead - 1;
+
+      Obj* object = (Obj*)(blocks + index * page->blockSize);
+      if (isYoung && object->type == OBJ_STRING &&
+          ((ObjString*)object)->isInterned) {
+        tableDelete(&vm.strings, (ObjString*)object);
+      }
+      freeObject(object);
+    }
+  }
+
+  // A major collection takes pages out of use until they are swept, and
+  // freeBlock() only puts back those where something died.
+  if (page->liveCount != 0 && !page->isAvailable && !isFull(page)) {
+    linkPage(page);
+  }
+}
+static PoolPage* arenaPage(uint8_t* arena, int index) {
+  return (PoolPage*)(alignToPage(arena) + index * POOL_PAGE_SIZE);
+}
 static void markRoots() {
   for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
     markValue(*slot);
@@ -194,44 +860,232 @@ static void markRoots() {
   markObject((Obj*)vm.initString);
 }
 static void traceReferences() {
+#ifdef CLOX_PARALLEL_GC
+  if (traceInParallel()) return;
+#endif
+
   while (vm.grayCount > 0) {
     Obj* object = vm.grayStack[--vm.grayCount];
     blackenObject(object);
   }
 }
-static void sweep() {
-  Obj* previous = NULL;
+// Old objects referencing young ones are traced again by a minor
+// collection, as nothing else would mark what they point to.
+static void markRememberedSet() {
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    grayObject(vm.rememberedSet[i]);
+  }
+}
+static void forgetRememberedSet() {
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    vm.rememberedSet[i]->isRemembered = false;
+  }
+  vm.rememberedCount = 0;
+}
+// Every young object that survives is promoted, leaving it marked.
+// Dead strings are removed from the string table as they are found,
+// which is cheaper than scanning the table for the few young ones.
+// Young pooled objects can only be on the nursery pages.
+static void sweepYoung() {
+  PoolPage* page = nurseryPages;
+  while (page != NULL) {
+    PoolPage* next = page->nextNursery;
+    page->isNursery = false;
+    if (page->isObjects) sweepPage(page, true);
+    page = next;
+  }
+  nurseryPages = NULL;
+
   Obj* object = vm.objects;
   while (object != NULL) {
-    if (object->isMarked) {
-      object->isMarked = false;
-      previous = object;
-      object = object->next;
+    Obj* next = NEXT_OBJ(object);
+    if (IS_MARKED(object)) {
+      NEXT_OBJ(object) = vm.oldObjects;
+      vm.oldObjects = object;
     } else {
-      Obj* unreached = object;
-      object = object->next;
-      if (previous != NULL) {
-        previous->next = object;
+      if (object->type == OBJ_STRING &&
+          ((ObjString*)object)->isInterned) {
+        tableDelete(&vm.strings, (ObjString*)object);
+      }
+      freeObject(object);
+    }
+    object = next;
+  }
+
+  vm.objects = NULL;
+}
+// Only traces and sweeps the objects allocated since the last
+// collection, using the remembered set for references from old ones.
+static void collectYoung() {
+  markRememberedSet();
+  markRoots();
+  traceReferences();
+  forgetRememberedSet();
+  sweepYoung();
+  vm.gcStats.minorCollections++;
+}
+static unsigned long now() {
+  return (unsigned long)AS_NUMBER(gfx_micros());
+}
+static bool isOverBudget(unsigned long start, unsigned long budget) {
+  return budget != 0 && now() - start >= budget;
+}
+static void startCycle() {
+  // Flipping the epoch unmarks every object at once. Young objects were
+  // unmarked under the old epoch, which now means marked, so they are
+  // unmarked again explicitly.
+  for (PoolPage* page = nurseryPages; page != NULL;
+       page = page->nextNursery) {
+    memset(page->marks, vm.markEpoch ? 0xff : 0, sizeof(page->marks));
+    page->isNursery = false;
+  }
+  nurseryPages = NULL;
+
+  vm.markEpoch = !vm.markEpoch;
+  for (Obj* object = vm.objects; object != NULL;
+       object = NEXT_OBJ(object)) {
+    object->mark = !vm.markEpoch;
+  }
+
+  vm.gcPhase = GC_MARK;
+  markRoots();
+}
+static bool markSome(unsigned long start, unsigned long budget) {
+  if (budget == 0) {
+    traceReferences();
+    return true;
+  }
+
+  while (vm.grayCount > 0) {
+    for (int i = 0; i < GC_STEP_OBJECTS && vm.grayCount > 0; i++) {
+      blackenObject(vm.grayStack[--vm.grayCount]);
+    }
+    if (isOverBudget(start, budget)) return false;
+  }
+  return true;
+}
+static void finishMarking() {
+  // The stack, globals and other roots are written without a barrier,
+  // so they are marked again before anything is swept.
+  markRoots();
+  traceReferences();
+  forgetRememberedSet();
+  tableRemoveWhite(&vm.strings);
+
+  // Objects allocated from now on are young and not part of the sweep,
+  // so every page holding objects is taken out of use until swept.
+  for (uint8_t* arena = arenas; arena != NULL;
+       arena = arenaTail(arena)->previous) {
+    for (int i = 0; i < POOL_ARENA_PAGES; i++) {
+      PoolPage* page = arenaPage(arena, i);
+      if (page->liveCount == 0 || !page->isObjects) continue;
+
+      if (page->isAvailable) unlinkPage(page);
+      int sizeClass = sizeClassOf(page);
+      page->next = unsweptPages[sizeClass];
+      unsweptPages[sizeClass] = page;
+    }
+  }
+
+  vm.unsweptYoung = vm.objects;
+  vm.unsweptOld = vm.oldObjects;
+  vm.objects = NULL;
+  vm.oldObjects = NULL;
+  vm.gcPhase = GC_SWEEP;
+}
+static bool sweepSome(unsigned long start, unsigned long budget) {
+  while (vm.unsweptYoung != NULL || vm.unsweptOld != NULL) {
+    for (int i = 0; i < GC_STEP_OBJECTS; i++) {
+      Obj** list = vm.unsweptYoung != NULL ? &vm.unsweptYoung
+                                           : &vm.unsweptOld;
+      Obj* object = *list;
+      if (object == NULL) break;
+      *list = NEXT_OBJ(object);
+
+      if (IS_MARKED(object)) {
+        NEXT_OBJ(object) = vm.oldObjects;
+        vm.oldObjects = object;
       } else {
-        vm.objects = object;
+        freeObject(object);
       }
+    }
+    if (isOverBudget(start, budget)) return false;
+  }
 
-      freeObject(unreached);
+  // Allocation sweeps pages of the size it needs, which leaves the rest
+  // to be swept here.
+  for (int i = 0; i < POOL_CLASS_COUNT; i++) {
+    while (unsweptPages[i] != NULL) {
+      PoolPage* page = unsweptPages[i];
+      unsweptPages[i] = page->next;
+      sweepPage(page, false);
+      if (isOverBudget(start, budget)) return false;
     }
   }
+
+  vm.gcPhase = GC_IDLE;
+  return true;
 }
-void collectGarbage() {
+static void recordPause(unsigned long pause) {
+  static const unsigned long limits[GC_PAUSE_BUCKETS - 1] = {
+    100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000
+  };
+
+  GcPauses* pauses = &vm.gcPauses;
+  pauses->count++;
+  pauses->total += pause;
+  if (pause > pauses->longest) pauses->longest = pause;
+
+  int bucket = 0;
+  while (bucket < GC_PAUSE_BUCKETS - 1 && pause >= limits[bucket]) {
+    bucket++;
+  }
+  pauses->histogram[bucket]++;
+}
+static void scheduleNextGC() {
+  if (vm.gcPhase != GC_IDLE) {
+    vm.nextGC = vm.bytesAllocated + GC_STEP_SIZE;
+  } else {
+    vm.nextGC = vm.bytesAllocated + vm.gcNurserySize;
+    if (vm.nextGC > vm.nextMajorGC) vm.nextGC = vm.nextMajorGC;
+  }
+}
+// Minor collections run whenever vm.gcNurserySize bytes have been
+// allocated. Once the heap has grown by vm.gcGrowFactor since the last
+// major collection, a major one is started instead, which marks and
+// sweeps every object in steps of at most budget microseconds (or all
+// at once if that is zero). Minor collections wait until it is done.
+static void collect(bool isMajor, unsigned long budget) {
+  unsigned long start = now();
+
 #ifdef DEBUG_LOG_GC
   printf("-- gc begin\n");
   size_t before = vm.bytesAllocated;
 #endif
 
-  markRoots();
-  traceReferences();
-  tableRemoveWhite(&vm.strings);
-  sweep();
+  if (vm.gcPhase == GC_IDLE && !isMajor &&
+      vm.bytesAllocated <= vm.nextMajorGC) {
+    collectYoung();
+  } else {
+    if (vm.gcPhase == GC_IDLE) startCycle();
 
-  vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    // Finish in one go if allocation is outpacing the steps.
+    if (vm.bytesAllocated > vm.nextMajorGC * vm.gcGrowFactor) {
+      budget = 0;
+    }
+
+    if (vm.gcPhase == GC_MARK && markSome(start, budget)) {
+      finishMarking();
+    }
+    if (vm.gcPhase == GC_SWEEP && sweepSome(start, budget)) {
+      vm.nextMajorGC = (size_t)(vm.bytesAllocated * vm.gcGrowFactor);
+      vm.gcStats.majorCollections++;
+      if (vm.bytesAllocated <= vm.heapLimit) vm.heapReserve = 0;
+    }
+  }
+
+  scheduleNextGC();
+  recordPause(now() - start);
 
 #ifdef DEBUG_LOG_GC
   printf("-- gc end\n");
@@ -240,13 +1094,103 @@ void collectGarbage() {
          vm.nextGC);
 #endif
 }
-void freeObjects() {
-  Obj* object = vm.objects;
+void collectGarbage() {
+  collect(false, vm.gcStepMicros);
+}
+// Lets the program do the work the next allocation would otherwise
+// trigger at a time that suits it, such as between animation frames.
+void collectGarbageStep(unsigned long budget) {
+  collect(false, budget);
+}
+void collectAllGarbage() {
+  // A cycle already under way keeps everything allocated since it
+  // started, so it is finished before a new one frees the rest.
+  if (vm.gcPhase != GC_IDLE) collect(true, 0);
+  collect(true, 0);
+}
+void setGcThresholds(size_t nurserySize, size_t heapSize,
+                     double growFactor) {
+  vm.gcNurserySize = nurserySize;
+  vm.gcGrowFactor = growFactor;
+  if (vm.gcPhase == GC_IDLE) {
+    vm.nextMajorGC = heapSize;
+    scheduleNextGC();
+  }
+}
+void printGcPauses() {
+  static const char* labels[GC_PAUSE_BUCKETS] = {
+    "<0.1", "<0.2", "<0.5", "<1", "<2", "<5", "<10", "<20", "<50", ">=50"
+  };
+
+  GcPauses* pauses = &vm.gcPauses;
+  printf("%lu pauses, longest %lu us, average %lu us\n", pauses->count,
+         pauses->longest,
+         pauses->count == 0 ? 0 : pauses->total / pauses->count);
+  for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+    if (pauses->histogram[i] == 0) continue;
+    printf("%5s ms: %lu\n", labels[i], pauses->histogram[i]);
+  }
+}
+// Calls visitor for every object on the heap, including any which a
+// cycle in progress has yet to sweep. It must not allocate.
+void visitObjects(ObjectVisitor visitor) {
+  Obj* lists[] = {
+    vm.objects, vm.oldObjects, vm.unsweptYoung, vm.unsweptOld
+  };
+  for (int i = 0; i < 4; i++) {
+    for (Obj* object = lists[i]; object != NULL;
+         object = NEXT_OBJ(object)) {
+      visitor(object);
+    }
+  }
+
+  for (uint8_t* arena = arenas; arena != NULL;
+       arena = arenaTail(arena)->previous) {
+    for (int i = 0; i < POOL_ARENA_PAGES; i++) {
+      PoolPage* page = arenaPage(arena, i);
+      if (page->liveCount == 0 || !page->isObjects) continue;
+
+      uint8_t* blocks = (uint8_t*)page + POOL_HEADER_SIZE;
+      for (int j = 0; j < POOL_BITMAP_WORDS; j++) {
+        uint32_t allocated = page->allocated[j];
+        while (allocated != 0) {
+          int index = j * 32 + __builtin_ctz(allocated);
+          allocated &= allocated - 1;
+          visitor((Obj*)(blocks + index * page->blockSize));
+        }
+      }
+    }
+  }
+}
+static void freeList(Obj* object) {
   while (object != NULL) {
-    Obj* next = object->next;
+    Obj* next = NEXT_OBJ(object);
     freeObject(object);
     object = next;
   }
+}
+void freeObjects() {
+  freeList(vm.objects);
+  freeList(vm.oldObjects);
+  freeList(vm.unsweptYoung);
+  freeList(vm.unsweptOld);
+
+  // Unmarking every pooled object lets sweeping free them all.
+  for (uint8_t* arena = arenas; arena != NULL;
+       arena = arenaTail(arena)->previous) {
+    for (int i = 0; i < POOL_ARENA_PAGES; i++) {
+      PoolPage* page = arenaPage(arena, i);
+      if (page->liveCount == 0 || !page->isObjects) continue;
+
+      memset(page->marks, vm.markEpoch ? 0 : 0xff, sizeof(page->marks));
+      sweepPage(page, false);
+    }
+  }
 
   free(vm.grayStack);
+  free(vm.rememberedSet);
+#ifdef CLOX_PARALLEL_GC
+  freeWorkers();
+#endif
+  freePools();
 }
@@ -3,26 +3,117 @@
 
 #include "common.h"
 #include "object.h"
+#include "vm.h"
 
 #define ALLOCATE(type, count) \
-    (type*)reallocate(NULL, 0, sizeof(type) * (count))
+    (type*)reallocateBlock(NULL, 0, sizeof(type) * (count))
 
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+#define FREE(type, pointer) reallocateBlock(pointer, sizeof(type), 0)
+
+// Size of an object of the given type with a trailing array member of
+// count elements.
+#define FLEX_SIZE(type, elementType, count) \
+    (sizeof(type) + sizeof(elementType) * (count))
 
 #define GROW_CAPACITY(capacity) \
     ((capacity) < 8 ? 8 : (capacity) * 2)
 
 #define GROW_ARRAY(type, pointer, oldCount, newCount) \
-    (type*)reallocate(pointer, sizeof(type) * (oldCount), \
+    (type*)reallocateBlock(pointer, sizeof(type) * (oldCount), \
         sizeof(type) * (newCount))
 
 #define FREE_ARRAY(type, pointer, oldCount) \
-    reallocate(pointer, sizeof(type) * (oldCount), 0)
+    reallocateBlock(pointer, sizeof(type) * (oldCount), 0)
+
+// Defaults for the thresholds set by setGcThresholds(): bytes allocated
+// between minor collections, the heap size at which the first major
+// collection starts, and how much the heap may grow after each one
+// before the next.
+#define GC_NURSERY_SIZE (128 * 1024)
+#define GC_INITIAL_HEAP (1024 * 1024)
+#define GC_HEAP_GROW_FACTOR 2
+
+// The pools objects and small arrays are allocated from are described
+// in memory.c. Pooled objects keep their mark bits in a bitmap in their
+// page's header, so that sweeping a page only reads the header and the
+// dead objects.
+#define POOL_GRANULE 8
+#define POOL_PAGE_SIZE 1024
+#define POOL_BITMAP_WORDS (POOL_PAGE_SIZE / 16 / 32)
+
+typedef struct PoolPage {
+  struct PoolPage* next;
+  struct PoolPage* previous;
+  struct PoolPage* nextNursery;
+  struct PoolBlock* freeBlocks;
+  uint8_t* unused;
+  uint16_t blockSize;
+  // 65536 / blockSize rounded up, which gives the index of a block
+  // without a division.
+  uint16_t reciprocal;
+  uint16_t liveCount;
+  bool isAvailable;
+  bool isObjects;
+  bool isNursery;
+  // Only used by pages of objects, which are at least 16 bytes.
+  uint32_t allocated[POOL_BITMAP_WORDS];
+  uint32_t marks[POOL_BITMAP_WORDS];
+} PoolPage;
+
+#define POOL_HEADER_SIZE \
+    ((sizeof(PoolPage) + POOL_GRANULE - 1) & ~(POOL_GRANULE - 1))
+
+#define PAGE_OF(block) \
+    ((PoolPage*)((uintptr_t)(block) & ~(uintptr_t)(POOL_PAGE_SIZE - 1)))
+
+#define BLOCK_INDEX(page, block) \
+    ((int)(((uint32_t)((uint8_t*)(block) - (uint8_t*)(page) - \
+                       POOL_HEADER_SIZE) * (page)->reciprocal) >> 16))
+
+static inline bool isMarked(Obj* object) {
+  if (!object->isPooled) return object->mark == vm.markEpoch;
+
+  PoolPage* page = PAGE_OF(object);
+  int index = BLOCK_INDEX(page, object);
+  return ((page->marks[index / 32] >> (index % 32)) & 1) == vm.markEpoch;
+}
+
+#define IS_MARKED(object) isMarked(object)
+
+// Must follow every store of value into an object that may already be
+// marked, whether because it is old or because it has been traced by
+// the current incremental cycle.
+#define WRITE_BARRIER(owner, value) \
+    do { \
+      Obj* owner_ = (Obj*)(owner); \
+      if (IS_MARKED(owner_) && IS_OBJ(value) && \
+          !IS_MARKED(AS_OBJ(value))) { \
+        writeBarrier(owner_, AS_OBJ(value)); \
+      } \
+    } while (false)
+
+typedef void (*ObjectVisitor)(Obj* object);
 
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+void reclaimMemory();
+void checkHeapLimit(size_t oldSize, size_t newSize);
+void outOfMemory(size_t oldSize, size_t newSize);
+void* reallocateBlock(void* pointer, size_t oldSize, size_t newSize);
+Obj* allocateObjectMemory(size_t size);
 void markObject(Obj* object);
 void markValue(Value value);
+void initMark(Obj* object);
+void writeBarrier(Obj* owner, Obj* value);
+void printGcPauses();
+#ifdef CLOX_PARALLEL_GC
+int setGcThreads(int count);
+#endif
+void setGcThresholds(size_t nurserySize, size_t heapSize,
+                     double growFactor);
 void collectGarbage();
+void collectGarbageStep(unsigned long budget);
+void collectAllGarbage();
+void visitObjects(ObjectVisitor visitor);
 void freeObjects();
 
 #endif
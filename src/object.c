@@ -11,12 +11,11 @@
     (type*)allocateObject(sizeof(type), objectType)
 
 static Obj* allocateObject(size_t size, ObjType type) {
-  Obj* object = (Obj*)reallocate(NULL, 0, size);
+  Obj* object = allocateObjectMemory(size);
   object->type = type;
-  object->isMarked = false;
-  
-  object->next = vm.objects;
-  vm.objects = object;
+  object->isRemembered = false;
+  initMark(object);
+  vm.gcStats.objectCounts[type]++;
 
 #ifdef DEBUG_LOG_GC
   printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -39,23 +38,29 @@ ObjClass* newClass(ObjString* name) {
   return klass;
 }
 ObjClosure* newClosure(ObjFunction* function) {
-  ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*,
-                                   function->upvalueCount);
-  for (int i = 0; i < function->upvalueCount; i++) {
-    upvalues[i] = NULL;
-  }
-
-  ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+  ObjClosure* closure = (ObjClosure*)allocateObject(
+      FLEX_SIZE(ObjClosure, ObjUpvalue*, function->upvalueCount),
+      OBJ_CLOSURE);
   closure->function = function;
-  closure->upvalues = upvalues;
   closure->upvalueCount = function->upvalueCount;
+  for (int i = 0; i < function->upvalueCount; i++) {
+    closure->upvalues[i] = NULL;
+  }
   return closure;
 }
 ObjFunction* newFunction() {
   ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
   function->arity = 0;
   function->upvalueCount = 0;
+  function->usesEnclosingFrame = false;
   function->name = NULL;
+  function->sharedClosure = NULL;
+#ifdef CLOX_JIT
+  function->hotness = 0;
+#endif
+#ifdef CLOX_COMPILED_CODE
+  function->compiled = NULL;
+#endif
   initChunk(&function->chunk);
   return function;
 }
@@ -68,40 +73,55 @@ ObjInstance* newInstance(ObjClass* klass) {
 ObjNative* newNative(NativeFn function) {
   ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
   native->function = function;
+  native->arity = -1;
+  native->isPure = false;
   return native;
 }
 
-static ObjString* allocateString(char* chars, int length,
-                                 uint32_t hash) {
-  ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+// Allocates a string with room for length characters stored inline,
+// which the caller fills in.
+ObjString* allocateString(int length) {
+  ObjString* string = (ObjString*)allocateObject(
+      FLEX_SIZE(ObjString, char, length + 1), OBJ_STRING);
   string->length = length;
-  string->chars = chars;
-  string->hash = hash;
-
-  push(OBJ_VAL(string));
-  tableSet(&vm.strings, string, NIL_VAL);
-  pop();
-
+  string->hash = 0;
+  string->isInterned = false;
+  string->isSlice = false;
+  string->chars[length] = '\0';
   return string;
 }
+static inline uint32_t mixHash(uint32_t hash, uint32_t word) {
+  return ((hash << 5 | hash >> 27) ^ word) * 0x9e3779b1u;
+}
+// Hashes four bytes at a time with one multiply each, rather than one
+// per byte. The multiplies leave the high bits well mixed but not the
+// low ones the table uses, so the result is spread by a final mix.
 static uint32_t hashString(const char* key, int length) {
-  uint32_t hash = 2166136261u;
-  for (int i = 0; i < length; i++) {
-    hash ^= (uint8_t)key[i];
-    hash *= 16777619;
+  uint32_t hash = 2166136261u ^ (uint32_t)length;
+  int i = 0;
+  for (; i + 4 <= length; i += 4) {
+    uint32_t word;
+    memcpy(&word, key + i, sizeof(word));
+    hash = mixHash(hash, word);
   }
+  for (; i < length; i++) {
+    hash = mixHash(hash, (uint8_t)key[i]);
+  }
+
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35u;
+  hash ^= hash >> 16;
   return hash;
 }
-ObjString* takeString(char* chars, int length) {
-  uint32_t hash = hashString(chars, length);
-  ObjString* interned = tableFindString(&vm.strings, chars, length,
-                                        hash);
-  if (interned != NULL) {
-    FREE_ARRAY(char, chars, length + 1);
-    return interned;
-  }
+static ObjString* internString(ObjString* string) {
+  string->isInterned = true;
+  push(OBJ_VAL(string));
+  tableSet(&vm.strings, string, NIL_VAL);
+  pop();
 
-  return allocateString(chars, length, hash);
+  return string;
 }
 ObjString* copyString(const char* chars, int length) {
   uint32_t hash = hashString(chars, length);
@@ -109,10 +129,59 @@ ObjString* copyString(const char* chars, int length) {
                                         hash);
   if (interned != NULL) return interned;
 
-  char* heapChars = ALLOCATE(char, length + 1);
-  memcpy(heapChars, chars, length);
-  heapChars[length] = '\0';
-  return allocateString(heapChars, length, hash);
+  ObjString* string = allocateString(length);
+  memcpy(string->chars, chars, length);
+  string->hash = hash;
+  return internString(string);
+}
+// Copies chars into a string which isn't interned, for results which
+// may well only be printed.
+ObjString* newString(const char* chars, int length) {
+  ObjString* string = allocateString(length);
+  memcpy(string->chars, chars, length);
+  return string;
+}
+// Substrings shorter than this are copied, as a copy is no bigger than
+// a slice and doesn't keep the whole string alive.
+#define SLICE_MIN_LENGTH 16
+
+ObjString* newSubstring(ObjString* string, int start, int length) {
+  const char* chars = stringChars(string) + start;
+  if (length < SLICE_MIN_LENGTH) return newString(chars, length);
+
+  // Slices share the characters of the string at the bottom, never of
+  // another slice.
+  ObjString* parent = string->isSlice ? ((ObjSlice*)string)->parent
+                                      : string;
+  ObjSlice* slice = ALLOCATE_OBJ(ObjSlice, OBJ_STRING);
+  slice->length = length;
+  slice->hash = 0;
+  slice->isInterned = false;
+  slice->isSlice = true;
+  slice->parent = parent;
+  slice->chars = chars;
+  return (ObjString*)slice;
+}
+// Returns the characters of a string followed by a '\0', which a slice
+// which ends before its parent does is first given a copy of.
+const char* stringCString(ObjString* string) {
+  if (!string->isSlice) return string->chars;
+
+  ObjSlice* slice = (ObjSlice*)string;
+  if (slice->chars[slice->length] != '\0') {
+    ObjString* copy = newString(slice->chars, slice->length);
+    slice->parent = copy;
+    slice->chars = copy->chars;
+    WRITE_BARRIER(slice, OBJ_VAL(copy));
+  }
+  return slice->chars;
+}
+// Interned strings are only equal to themselves.
+bool stringsEqual(ObjString* a, ObjString* b) {
+  if (a == b) return true;
+  if (a->isInterned && b->isInterned) return false;
+  return a->length == b->length &&
+         memcmp(stringChars(a), stringChars(b), a->length) == 0;
 }
 ObjUpvalue* newUpvalue(Value* slot) {
   ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
@@ -122,6 +191,11 @@ ObjUpvalue* newUpvalue(Value* slot) {
   return upvalue;
 }
 static void printFunction(ObjFunction* function) {
+#ifdef CLOX_STRIP_DEBUG_INFO
+  // Without names, functions can't be told from the script.
+  printf("<fn>");
+  return;
+#endif
   if (function->name == NULL) {
     printf("<script>");
     return;
@@ -141,16 +215,19 @@ void appendToList(ObjList* list, Value value) {
   // Grow the array if necessary
   if (list->capacity < list->count + 1) {
       int oldCapacity = list->capacity;
+      list->items = GROW_ARRAY(Value, list->items, oldCapacity,
+                               GROW_CAPACITY(oldCapacity));
       list->capacity = GROW_CAPACITY(oldCapacity);
-      list->items = GROW_ARRAY(Value, list->items, oldCapacity, list->capacity);
   }
   list->items[list->count] = value;
   list->count++;
+  WRITE_BARRIER(list, value);
   return;
 }
 
 void storeToList(ObjList* list, int index, Value value) {
   list->items[index] = value;
+  WRITE_BARRIER(list, value);
 }
 
 Value indexFromList(ObjList* list, int index) {
@@ -171,6 +248,27 @@ bool isValidListIndex(ObjList* list, int index) {
   }
   return true;
 }
+ObjBuilder* newBuilder() {
+  ObjBuilder* builder = ALLOCATE_OBJ(ObjBuilder, OBJ_BUILDER);
+  builder->length = 0;
+  builder->capacity = 0;
+  builder->chars = NULL;
+  return builder;
+}
+
+void appendToBuilder(ObjBuilder* builder, const char* chars, int length) {
+  if (builder->capacity < builder->length + length) {
+    int capacity = builder->capacity;
+    while (capacity < builder->length + length) {
+      capacity = GROW_CAPACITY(capacity);
+    }
+    builder->chars = GROW_ARRAY(char, builder->chars, builder->capacity,
+                                capacity);
+    builder->capacity = capacity;
+  }
+  memcpy(builder->chars + builder->length, chars, length);
+  builder->length += length;
+}
 void printObject(Value value) {
   switch (OBJ_TYPE(value)) {
     case OBJ_BOUND_METHOD:
@@ -193,11 +291,19 @@ void printObject(Value value) {
       printf("<native fn>");
       break;
     case OBJ_STRING:
-      printf("%s", AS_CSTRING(value));
+      printf("%.*s", AS_STRING(value)->length,
+             stringChars(AS_STRING(value)));
       break;
     case OBJ_LIST:
       printf("list");
       break;
+    case OBJ_BUILDER: {
+      ObjBuilder* builder = AS_BUILDER(value);
+      if (builder->length > 0) {
+        printf("%.*s", builder->length, builder->chars);
+      }
+      break;
+    }
     case OBJ_UPVALUE:
       printf("upvalue");
       break;
@@ -16,6 +16,7 @@
 #define IS_NATIVE(value)       isObjType(value, OBJ_NATIVE)
 #define IS_STRING(value)       isObjType(value, OBJ_STRING)
 #define IS_LIST(value)         isObjType(value, OBJ_LIST)
+#define IS_BUILDER(value)      isObjType(value, OBJ_BUILDER)
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
 #define AS_CLASS(value)        ((ObjClass*)AS_OBJ(value))
@@ -25,8 +26,9 @@
 #define AS_NATIVE(value) \
     (((ObjNative*)AS_OBJ(value))->function)
 #define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
-#define AS_CSTRING(value)      (((ObjString*)AS_OBJ(value))->chars)
+#define AS_CSTRING(value)      stringCString(AS_STRING(value))
 #define AS_LIST(value)         ((ObjList*)AS_OBJ(value))
+#define AS_BUILDER(value)      ((ObjBuilder*)AS_OBJ(value))
 
 typedef enum {
   OBJ_BOUND_METHOD,
@@ -37,21 +39,50 @@ typedef enum {
   OBJ_NATIVE,
   OBJ_STRING,
   OBJ_LIST,
+  OBJ_BUILDER,
   OBJ_UPVALUE
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_UPVALUE + 1)
+
+// An object is marked when mark equals vm.markEpoch. Marks are sticky:
+// objects which survive a collection stay marked and are old from then
+// on, until a major collection flips the epoch to unmark everything.
+//
+// Objects allocated from the pools keep their mark in the page instead
+// (see memory.h). Only large objects are on the object lists, linked
+// through a pointer stored in front of the header by memory.c.
 struct Obj {
-  ObjType type;
-  bool isMarked;
-  struct Obj* next;
+  uint8_t type;
+  bool mark;
+  bool isRemembered;
+  bool isPooled;
 };
 
+typedef struct ObjClosure ObjClosure;
+
+#ifdef CLOX_COMPILED_CODE
+// Machine code for a function, which runs the frame from frame->ip
+// until an instruction it leaves to run().
+struct CallFrame;
+typedef void (*CompiledCode)(struct CallFrame* frame);
+#endif
+
 typedef struct {
   Obj obj;
   int arity;
   int upvalueCount;
+  bool usesEnclosingFrame;
   Chunk chunk;
   ObjString* name;
+  ObjClosure* sharedClosure;
+#ifdef CLOX_JIT
+  // Calls and loop iterations counted until it is compiled.
+  int hotness;
+#endif
+#ifdef CLOX_COMPILED_CODE
+  CompiledCode compiled;
+#endif
 } ObjFunction;
 
 typedef Value (*NativeFn)(int argCount, Value* args);
@@ -59,15 +90,40 @@ typedef Value (*NativeFn)(int argCount, Value* args);
 typedef struct {
   Obj obj;
   NativeFn function;
+  int arity;
+  bool isPure;
 } ObjNative;
 
+// Strings from the source and natives' names are interned, so that
+// only one string with given contents is in vm.strings, and tables can
+// look them up by address. The results of string operations are not
+// interned, as most are only printed, so they are compared by contents
+// and can't be used as table keys. Their hash isn't computed either.
+//
+// A string may also be a slice of another (see ObjSlice), whose chars
+// are read with stringChars().
 struct ObjString {
   Obj obj;
   int length;
-  char* chars;
   uint32_t hash;
+  bool isInterned;
+  bool isSlice;
+  char chars[];
 };
 
+// A substring which shares the characters of the string it was taken
+// from, and keeps it alive. It begins like an ObjString. Its characters
+// are only followed by a '\0' if it runs to the end of that string.
+typedef struct {
+  Obj obj;
+  int length;
+  uint32_t hash;
+  bool isInterned;
+  bool isSlice;
+  ObjString* parent;
+  const char* chars;
+} ObjSlice;
+
 typedef struct {
   Obj obj;
   int count;
@@ -75,18 +131,28 @@ typedef struct {
   Value* items;
 } ObjList;
 
+// Text appended a piece at a time, into an array which doubles as it
+// fills. Unlike concatenating strings with +, which copies the whole
+// string each time, this takes time linear in the length.
+typedef struct {
+  Obj obj;
+  int length;
+  int capacity;
+  char* chars;
+} ObjBuilder;
+
 typedef struct ObjUpvalue {
   Obj obj;
   Value* location;
   Value closed;
   struct ObjUpvalue* next;
 } ObjUpvalue;
-typedef struct {
+struct ObjClosure {
   Obj obj;
   ObjFunction* function;
-  ObjUpvalue** upvalues;
   int upvalueCount;
-} ObjClosure;
+  ObjUpvalue* upvalues[];
+};
 
 typedef struct {
   Obj obj;
@@ -113,14 +179,20 @@ ObjClosure* newClosure(ObjFunction* function);
 ObjFunction* newFunction();
 ObjInstance* newInstance(ObjClass* klass);
 ObjNative* newNative(NativeFn function);
-ObjString* takeString(char* chars, int length);
+ObjString* allocateString(int length);
 ObjString* copyString(const char* chars, int length);
+ObjString* newString(const char* chars, int length);
+ObjString* newSubstring(ObjString* string, int start, int length);
+const char* stringCString(ObjString* string);
+bool stringsEqual(ObjString* a, ObjString* b);
 ObjList* newList();
 void appendToList(ObjList* list, Value value);
 void storeToList(ObjList* list, int index, Value value);
 Value indexFromList(ObjList* list, int index);
 void deleteFromList(ObjList* list, int index);
 bool isValidListIndex(ObjList* list, int index);
+ObjBuilder* newBuilder();
+void appendToBuilder(ObjBuilder* builder, const char* chars, int length);
 ObjUpvalue* newUpvalue(Value* slot);
 void printObject(Value value);
 
@@ -128,4 +200,8 @@ static inline bool isObjType(Value value, ObjType type) {
   return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+static inline const char* stringChars(ObjString* string) {
+  return string->isSlice ? ((ObjSlice*)string)->chars : string->chars;
+}
+
 #endif
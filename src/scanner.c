@@ -4,25 +4,133 @@
 #include "common.h"
 #include "scanner.h"
 
+// Source read from a SourceReader is scanned in a window of two halves.
+// The text left to scan is moved to a half which doesn't hold the last
+// token returned, as the compiler still uses that token, and only whole
+// lines are scanned so that no token but a string runs past the end.
+#define WINDOW_SIZE 1024
+
 typedef struct {
   const char* start;
   const char* current;
+  const char* end;
   int line;
+
+  SourceReader reader;
+  void* context;
+  int half;
+  int tokenHalf;
+  int filled;
+  char held; // The character under the '\0' at end.
+  bool isLineTooLong;
 } Scanner;
 
 Scanner scanner;
+static char window[2][WINDOW_SIZE + 1];
+
 void initScanner(const char* source) {
   scanner.start = source;
   scanner.current = source;
+  scanner.end = source + strlen(source);
   scanner.line = 1;
+  scanner.reader = NULL;
+  scanner.isLineTooLong = false;
+}
+void initScannerReader(SourceReader reader, void* context) {
+  window[0][0] = '\0';
+  initScanner(window[0]);
+  scanner.reader = reader;
+  scanner.context = context;
+  scanner.half = 0;
+  scanner.tokenHalf = 1;
+  scanner.filled = 0;
+  scanner.held = '\0';
 }
+// Moves the text from the start of the token being scanned to the start
+// of a half, reads more after it and returns whether there is more to
+// scan.
+static bool refill() {
+  if (scanner.reader == NULL) return false;
+
+  int half = scanner.tokenHalf == scanner.half ? !scanner.half
+                                               : scanner.half;
+  char* buffer = window[half];
+  *(char*)scanner.end = scanner.held;
+  int scanned = (int)(scanner.current - scanner.start);
+  int filled = (int)(window[scanner.half] + scanner.filled - scanner.start);
+  memmove(buffer, scanner.start, filled);
+
+  while (filled < WINDOW_SIZE) {
+    int count = scanner.reader(scanner.context, buffer + filled,
+                               WINDOW_SIZE - filled);
+    if (count <= 0) break;
+    filled += count;
+  }
+
+  // A full half ends after its last line break, leaving the partial
+  // line after it to be moved and finished by the next refill.
+  char* end = buffer + filled;
+  if (filled == WINDOW_SIZE) {
+    char* lineEnd = end;
+    while (lineEnd > buffer + scanned && lineEnd[-1] != '\n') lineEnd--;
+    if (lineEnd > buffer + scanned) {
+      end = lineEnd;
+    } else {
+      scanner.isLineTooLong = true;
+    }
+  }
+
+  scanner.start = buffer;
+  scanner.current = buffer + scanned;
+  scanner.end = end;
+  scanner.held = *end;
+  *end = '\0';
+  scanner.half = half;
+  scanner.filled = filled;
+  return scanner.end > scanner.current;
+}
+
+// Characters are classified by looking them up in a table. Line breaks
+// aren't spaces, as they are counted.
+#define CHAR_ALPHA 1
+#define CHAR_DIGIT 2
+#define CHAR_HEX 4
+#define CHAR_SPACE 8
+
+#define _ 0
+#define A CHAR_ALPHA
+#define D (CHAR_DIGIT | CHAR_HEX)
+#define H (CHAR_ALPHA | CHAR_HEX)
+#define S CHAR_SPACE
+
+static const uint8_t charClasses[256] = {
+  _, _, _, _, _, _, _, _, _, S, _, _, _, S, _, _,
+  _, _, _, _, _, _, _, _, _, _, _, _, _, _, _, _,
+  S, _, _, _, _, _, _, _, _, _, _, _, _, _, _, _,
+  D, D, D, D, D, D, D, D, D, D, _, _, _, _, _, _,
+  _, H, H, H, H, H, H, A, A, A, A, A, A, A, A, A,
+  A, A, A, A, A, A, A, A, A, A, A, _, _, _, _, A,
+  _, H, H, H, H, H, H, A, A, A, A, A, A, A, A, A,
+  A, A, A, A, A, A, A, A, A, A, A, _, _, _, _, _
+};
+
+#undef _
+#undef A
+#undef D
+#undef H
+#undef S
+
 static bool isAlpha(char c) {
-  return (c >= 'a' && c <= 'z') ||
-         (c >= 'A' && c <= 'Z') ||
-          c == '_';
+  return charClasses[(uint8_t)c] & CHAR_ALPHA;
 }
 static bool isDigit(char c) {
-  return c >= '0' && c <= '9';
+  return charClasses[(uint8_t)c] & CHAR_DIGIT;
+}
+static bool isHexDigit(char c) {
+  return charClasses[(uint8_t)c] & CHAR_HEX;
+}
+static bool isBinaryDigit(char c) {
+  return c == '0' || c == '1';
 }
 static bool isAtEnd() {
   return *scanner.current == '\0';
@@ -45,6 +153,8 @@ static bool match(char expected) {
   return true;
 }
 static Token makeToken(TokenType type) {
+  scanner.tokenHalf = scanner.half;
+
   Token token;
   token.type = type;
   token.start = scanner.start;
@@ -61,79 +171,95 @@ static Token errorToken(const char* message) {
   return token;
 }
 static void skipWhitespace() {
+  const char* current = scanner.current;
   for (;;) {
-    char c = peek();
-    switch (c) {
-      case ' ':
-      case '\r':
-      case '\t':
-        advance();
-        break;
-      case '\n':
-        scanner.line++;
-        advance();
-        break;
-      case '/':
-        if (peekNext() == '/') {
-          // A comment goes until the end of the line.
-          while (peek() != '\n' && !isAtEnd()) advance();
-        } else {
-          return;
-        }
-        break;
-      default:
-        return;
+    // Indentation is skipped four spaces at a time.
+    while (scanner.end - current >= 4 && memcmp(current, "    ", 4) == 0) {
+      current += 4;
+    }
+
+    char c = *current;
+    if (charClasses[(uint8_t)c] & CHAR_SPACE) {
+      current++;
+    } else if (c == '\n') {
+      scanner.line++;
+      current++;
+    } else if (c == '/' && current[1] == '/') {
+      // A comment goes until the end of the line.
+      current = (const char*)memchr(current, '\n', scanner.end - current);
+      if (current == NULL) current = scanner.end;
+    } else {
+      break;
     }
   }
+  scanner.current = current;
 }
-static TokenType checkKeyword(int start, int length,
-    const char* rest, TokenType type) {
-  if (scanner.current - scanner.start == start + length &&
-      memcmp(scanner.start + start, rest, length) == 0) {
-    return type;
-  }
 
-  return TOKEN_IDENTIFIER;
-}
+typedef struct {
+  const char* name;
+  int length;
+  TokenType type;
+} Keyword;
+
+// Each keyword has a slot of its own, found from its first and last
+// letters and its length, so an identifier is compared with at most
+// one keyword.
+#define KEYWORD_SLOT(first, last, length) \
+    (((uint8_t)(first) + (uint8_t)(last) * 5 + (length)) & 31)
+
+static const Keyword keywords[32] = {
+  [2]  = {"else", 4, TOKEN_ELSE},
+  [3]  = {"for", 3, TOKEN_FOR},
+  [4]  = {"false", 5, TOKEN_FALSE},
+  [7]  = {"class", 5, TOKEN_CLASS},
+  [9]  = {"if", 2, TOKEN_IF},
+  [11] = {"or", 2, TOKEN_OR},
+  [13] = {"nil", 3, TOKEN_NIL},
+  [15] = {"fun", 3, TOKEN_FUN},
+  [17] = {"true", 4, TOKEN_TRUE},
+  [18] = {"super", 5, TOKEN_SUPER},
+  [19] = {"var", 3, TOKEN_VAR},
+  [21] = {"while", 5, TOKEN_WHILE},
+  [23] = {"this", 4, TOKEN_THIS},
+  [24] = {"and", 3, TOKEN_AND},
+  [25] = {"print", 5, TOKEN_PRINT},
+  [30] = {"return", 6, TOKEN_RETURN}
+};
+
 static TokenType identifierType() {
-  switch (scanner.start[0]) {
-    case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
-    case 'c': return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-    case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-    case 'f':
-      if (scanner.current - scanner.start > 1) {
-        switch (scanner.start[1]) {
-          case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-          case 'o': return checkKeyword(2, 1, "r", TOKEN_FOR);
-          case 'u': return checkKeyword(2, 1, "n", TOKEN_FUN);
-        }
-      }
-      break;
-    case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
-    case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
-    case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
-    case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-    case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-    case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
-    case 't':
-      if (scanner.current - scanner.start > 1) {
-        switch (scanner.start[1]) {
-          case 'h': return checkKeyword(2, 2, "is", TOKEN_THIS);
-          case 'r': return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-        }
-      }
-      break;
-    case 'v': return checkKeyword(1, 2, "ar", TOKEN_VAR);
-    case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+  int length = (int)(scanner.current - scanner.start);
+  const Keyword* keyword = &keywords[KEYWORD_SLOT(
+      scanner.start[0], scanner.start[length - 1], length)];
+  if (keyword->length == length &&
+      memcmp(scanner.start, keyword->name, length) == 0) {
+    return keyword->type;
   }
 
   return TOKEN_IDENTIFIER;
 }
 static Token identifier() {
-  while (isAlpha(peek()) || isDigit(peek())) advance();
+  const char* current = scanner.current;
+  while (charClasses[(uint8_t)*current] & (CHAR_ALPHA | CHAR_DIGIT)) {
+    current++;
+  }
+  scanner.current = current;
   return makeToken(identifierType());
 }
 static Token number() {
+  // Hexadecimal and binary literals, as in 0xff and 0b1010.
+  if (scanner.start[0] == '0') {
+    if ((peek() == 'x' || peek() == 'X') && isHexDigit(peekNext())) {
+      advance();
+      while (isHexDigit(peek())) advance();
+      return makeToken(TOKEN_NUMBER);
+    }
+    if ((peek() == 'b' || peek() == 'B') && isBinaryDigit(peekNext())) {
+      advance();
+      while (isBinaryDigit(peek())) advance();
+      return makeToken(TOKEN_NUMBER);
+    }
+  }
+
   while (isDigit(peek())) advance();
 
   // Look for a fractional part.
@@ -147,23 +273,55 @@ static Token number() {
   return makeToken(TOKEN_NUMBER);
 }
 static Token string() {
-  while (peek() != '"' && !isAtEnd()) {
+  while (peek() != '"') {
+    if (isAtEnd()) {
+      // The string may go on past the lines read so far.
+      if (refill()) continue;
+      if (scanner.reader != NULL &&
+          scanner.current - scanner.start >= WINDOW_SIZE) {
+        return errorToken("String too long.");
+      }
+      return errorToken("Unterminated string.");
+    }
     if (peek() == '\n') scanner.line++;
     advance();
   }
 
-  if (isAtEnd()) return errorToken("Unterminated string.");
-
   // The closing quote.
   advance();
   return makeToken(TOKEN_STRING);
 }
+// Drops the rest of a line too long to fit in the window, reading on to
+// its end, so that scanning starts again on the next line rather than
+// partway through a token.
+static void skipLongLine() {
+  for (;;) {
+    const char* lineEnd = (const char*)memchr(
+        scanner.current, '\n', scanner.end - scanner.current);
+    if (lineEnd != NULL) {
+      scanner.current = lineEnd;
+      break;
+    }
+
+    scanner.current = scanner.end;
+    scanner.start = scanner.current;
+    if (!refill()) break;
+  }
+  scanner.isLineTooLong = false;
+}
 Token scanToken() {
-  skipWhitespace();
-  scanner.start = scanner.current;
+  for (;;) {
+    skipWhitespace();
+    scanner.start = scanner.current;
+    if (!isAtEnd() || !refill()) break;
+  }
 
+  if (scanner.isLineTooLong) {
+    skipLongLine();
+    return errorToken("Line too long.");
+  }
   if (isAtEnd()) return makeToken(TOKEN_EOF);
-  
+
   char c = advance();
   if (isAlpha(c)) return identifier();
   if (isDigit(c)) return number();
@@ -31,7 +31,12 @@ typedef struct {
   int line;
 } Token;
 
+// Reads up to size characters of source into buffer, returning how many
+// were read, or 0 at the end of the source.
+typedef int (*SourceReader)(void* context, char* buffer, int size);
+
 void initScanner(const char* source);
+void initScannerReader(SourceReader reader, void* context);
 Token scanToken();
 
 #endif
@@ -0,0 +1,275 @@
+#include "clox_stdio.h"
+#include <stdarg.h>
+#include <string.h>
+
+#include "memory.h"
+#include "object.h"
+#include "snapshot.h"
+#include "vm.h"
+
+// The snapshot is JSON, with each root and object on a line of its own
+// so that it can be picked out of a serial log:
+//
+//   {"heapSnapshot":1,"roots":[
+//   [id,"global points"],
+//   ...],"objects":[
+//   [id,"instance",size,"Point",[id,"class",id,"x",...]],
+//   ...]}
+//
+// Ids are the addresses of objects. References are pairs of the id of
+// the object referred to and the name of what holds it, and sizes
+// include any arrays owned by the object.
+
+#define LINE_SIZE 128
+#define LABEL_MAX 32
+
+static const char* typeNames[OBJ_TYPE_COUNT] = {
+  "boundMethod", "class", "closure", "function", "instance", "native",
+  "string", "list", "builder", "upvalue"
+};
+
+// Output is gathered into lines, as each printf() may be a separate
+// write to the serial port and web console.
+static char line[LINE_SIZE];
+static int lineLength = 0;
+static bool isFirstItem;
+static bool isFirstEdge;
+
+static void flush() {
+  if (lineLength == 0) return;
+  line[lineLength] = '\0';
+  printf("%s", line);
+  lineLength = 0;
+}
+static void emit(const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(line + lineLength, LINE_SIZE - lineLength,
+                         format, args);
+  va_end(args);
+
+  if (lineLength + length >= LINE_SIZE) {
+    flush();
+    va_start(args, format);
+    length = vsnprintf(line, LINE_SIZE, format, args);
+    va_end(args);
+  }
+  lineLength += length;
+}
+static void emitChar(char c) {
+  if (lineLength + 1 >= LINE_SIZE) flush();
+  line[lineLength++] = c;
+}
+static void emitString(const char* prefix, const char* chars, int length) {
+  emit("\"%s", prefix);
+  for (int i = 0; i < length && i < LABEL_MAX; i++) {
+    unsigned char c = (unsigned char)chars[i];
+    if (c == '"' || c == '\\') {
+      emitChar('\\');
+      emitChar((char)c);
+    } else if (c < ' ') {
+      emit("\\u%04x", c);
+    } else {
+      emitChar((char)c);
+    }
+  }
+  emit("%s\"", length > LABEL_MAX ? "..." : "");
+}
+static void beginItem() {
+  emit(isFirstItem ? "\n[" : ",\n[");
+  isFirstItem = false;
+}
+static unsigned long idOf(Obj* object) {
+  return (unsigned long)(uintptr_t)object;
+}
+
+static void root(Obj* object, const char* prefix, ObjString* name) {
+  if (object == NULL) return;
+  beginItem();
+  emit("%lu,", idOf(object));
+  emitString(prefix, name != NULL ? name->chars : "",
+             name != NULL ? name->length : 0);
+  emit("]");
+}
+static void rootValue(Value value, const char* prefix, ObjString* name) {
+  if (IS_OBJ(value)) root(AS_OBJ(value), prefix, name);
+}
+static void printRoots() {
+  for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+    rootValue(*slot, "stack", NULL);
+  }
+
+  for (int i = 0; i < vm.frameCount; i++) {
+    root((Obj*)vm.frames[i].closure, "frame", NULL);
+  }
+
+  for (ObjUpvalue* upvalue = vm.openUpvalues;
+       upvalue != NULL;
+       upvalue = upvalue->next) {
+    root((Obj*)upvalue, "open upvalue", NULL);
+  }
+
+  for (int i = 0; i < vm.globals.capacity; i++) {
+    Entry* entry = &vm.globals.entries[i];
+    if (entry->key == NULL) continue;
+    root((Obj*)entry->key, "global name ", entry->key);
+    rootValue(entry->value, "global ", entry->key);
+  }
+
+  root((Obj*)vm.initString, "initString", NULL);
+}
+
+static void edge(Obj* object, const char* name, int length) {
+  if (object == NULL) return;
+  emit(isFirstEdge ? "%lu," : ",%lu,", idOf(object));
+  emitString("", name, length);
+  isFirstEdge = false;
+}
+static void edgeValue(Value value, const char* name) {
+  if (IS_OBJ(value)) edge(AS_OBJ(value), name, (int)strlen(name));
+}
+static void edgeObject(void* object, const char* name) {
+  edge((Obj*)object, name, (int)strlen(name));
+}
+static void tableEdges(Table* table) {
+  for (int i = 0; i < table->capacity; i++) {
+    Entry* entry = &table->entries[i];
+    if (entry->key == NULL) continue;
+    edgeObject(entry->key, "key");
+    if (IS_OBJ(entry->value)) {
+      edge(AS_OBJ(entry->value), entry->key->chars, entry->key->length);
+    }
+  }
+}
+static size_t tableSize(Table* table) {
+  return sizeof(Entry) * table->capacity;
+}
+static size_t objectSize(Obj* object) {
+  switch (object->type) {
+    case OBJ_BOUND_METHOD: return sizeof(ObjBoundMethod);
+    case OBJ_CLASS:
+      return sizeof(ObjClass) + tableSize(&((ObjClass*)object)->methods);
+    case OBJ_CLOSURE:
+      return FLEX_SIZE(ObjClosure, ObjUpvalue*,
+                       ((ObjClosure*)object)->upvalueCount);
+    case OBJ_FUNCTION: {
+      Chunk* chunk = &((ObjFunction*)object)->chunk;
+      return sizeof(ObjFunction) +
+             sizeof(uint8_t) * chunk->capacity + chunk->linesLength +
+             sizeof(Value) * chunk->constants.capacity;
+    }
+    case OBJ_INSTANCE:
+      return sizeof(ObjInstance) +
+             tableSize(&((ObjInstance*)object)->fields);
+    case OBJ_NATIVE: return sizeof(ObjNative);
+    case OBJ_STRING:
+      if (((ObjString*)object)->isSlice) return sizeof(ObjSlice);
+      return FLEX_SIZE(ObjString, char, ((ObjString*)object)->length + 1);
+    case OBJ_LIST:
+      return sizeof(ObjList) + sizeof(Value) * ((ObjList*)object)->capacity;
+    case OBJ_BUILDER:
+      return sizeof(ObjBuilder) + ((ObjBuilder*)object)->capacity;
+    case OBJ_UPVALUE: return sizeof(ObjUpvalue);
+  }
+  return 0;
+}
+static ObjString* labelOf(Obj* object) {
+  switch (object->type) {
+    case OBJ_BOUND_METHOD:
+      return ((ObjBoundMethod*)object)->method->function->name;
+    case OBJ_CLASS: return ((ObjClass*)object)->name;
+    case OBJ_CLOSURE: return ((ObjClosure*)object)->function->name;
+    case OBJ_FUNCTION: return ((ObjFunction*)object)->name;
+    case OBJ_INSTANCE: return ((ObjInstance*)object)->klass->name;
+    case OBJ_STRING: return (ObjString*)object;
+    default: return NULL;
+  }
+}
+static void printEdges(Obj* object) {
+  switch (object->type) {
+    case OBJ_BOUND_METHOD: {
+      ObjBoundMethod* bound = (ObjBoundMethod*)object;
+      edgeValue(bound->receiver, "receiver");
+      edgeObject(bound->method, "method");
+      break;
+    }
+    case OBJ_CLASS: {
+      ObjClass* klass = (ObjClass*)object;
+      edgeObject(klass->name, "name");
+      tableEdges(&klass->methods);
+      break;
+    }
+    case OBJ_CLOSURE: {
+      ObjClosure* closure = (ObjClosure*)object;
+      edgeObject(closure->function, "function");
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        edgeObject(closure->upvalues[i], "upvalue");
+      }
+      break;
+    }
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*)object;
+      edgeObject(function->name, "name");
+      edgeObject(function->sharedClosure, "closure");
+      for (int i = 0; i < function->chunk.constants.count; i++) {
+        edgeValue(function->chunk.constants.values[i], "constant");
+      }
+      break;
+    }
+    case OBJ_INSTANCE: {
+      ObjInstance* instance = (ObjInstance*)object;
+      edgeObject(instance->klass, "class");
+      tableEdges(&instance->fields);
+      break;
+    }
+    case OBJ_UPVALUE:
+      edgeValue(((ObjUpvalue*)object)->closed, "value");
+      break;
+    case OBJ_LIST: {
+      ObjList* list = (ObjList*)object;
+      for (int i = 0; i < list->count; i++) {
+        char index[16];
+        snprintf(index, sizeof(index), "[%d]", i);
+        edgeValue(list->items[i], index);
+      }
+      break;
+    }
+    case OBJ_STRING:
+      if (((ObjString*)object)->isSlice) {
+        edgeObject(((ObjSlice*)object)->parent, "parent");
+      }
+      break;
+    case OBJ_NATIVE:
+    case OBJ_BUILDER:
+      break;
+  }
+}
+static void printSnapshotObject(Obj* object) {
+  beginItem();
+  emit("%lu,\"%s\",%lu,", idOf(object), typeNames[object->type],
+       (unsigned long)objectSize(object));
+
+  ObjString* label = labelOf(object);
+  emitString("", label != NULL ? stringChars(label) : "",
+             label != NULL ? label->length : 0);
+
+  emit(",[");
+  isFirstEdge = true;
+  printEdges(object);
+  emit("]]");
+}
+
+void printHeapSnapshot() {
+  // Leave only live objects, so that nothing printed refers to an
+  // object which has been freed.
+  collectAllGarbage();
+
+  emit("{\"heapSnapshot\":1,\"roots\":[");
+  isFirstItem = true;
+  printRoots();
+  emit("],\"objects\":[");
+  isFirstItem = true;
+  visitObjects(printSnapshotObject);
+  emit("]}\n");
+  flush();
+}
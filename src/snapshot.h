@@ -0,0 +1,10 @@
+#ifndef clox_snapshot_h
+#define clox_snapshot_h
+
+// Prints every object on the heap with its size and references, and
+// the roots that keep them alive, for extras/heap_snapshot to find
+// what a script is holding on to.
+
+void printHeapSnapshot();
+
+#endif
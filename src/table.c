@@ -99,13 +99,40 @@ bool tableDelete(Table* table, ObjString* key) {
   entry->value = BOOL_VAL(true);
   return true;
 }
-void tableAddAll(Table* from, Table* to) {
-  for (int i = 0; i < from->capacity; i++) {
-    Entry* entry = &from->entries[i];
-    if (entry->key != NULL) {
-      tableSet(to, entry->key, entry->value);
+// Moves the entries of a table which has had most of them deleted into
+// a smaller array. This needs no memory for a second copy, which may
+// not be there: the entries are packed at the end of the array and
+// then reinserted at the start, before the array is cut down to size.
+void tableShrink(Table* table) {
+  int count = 0;
+  for (int i = 0; i < table->capacity; i++) {
+    if (table->entries[i].key != NULL) count++;
+  }
+
+  int capacity = GROW_CAPACITY(0);
+  while (count + 1 > capacity * TABLE_MAX_LOAD) capacity *= 2;
+  if (capacity * 2 > table->capacity) return;
+
+  int packed = table->capacity;
+  for (int i = table->capacity - 1; i >= 0; i--) {
+    if (table->entries[i].key != NULL) {
+      table->entries[--packed] = table->entries[i];
     }
   }
+
+  for (int i = 0; i < capacity; i++) {
+    table->entries[i].key = NULL;
+    table->entries[i].value = NIL_VAL;
+  }
+  for (int i = packed; i < table->capacity; i++) {
+    Entry* entry = &table->entries[i];
+    *findEntry(table->entries, capacity, entry->key) = *entry;
+  }
+
+  table->entries = GROW_ARRAY(Entry, table->entries, table->capacity,
+                              capacity);
+  table->capacity = capacity;
+  table->count = count;
 }
 ObjString* tableFindString(Table* table, const char* chars,
                            int length, uint32_t hash) {
@@ -130,7 +157,7 @@ ObjString* tableFindString(Table* table, const char* chars,
 void tableRemoveWhite(Table* table) {
   for (int i = 0; i < table->capacity; i++) {
     Entry* entry = &table->entries[i];
-    if (entry->key != NULL && !entry->key->obj.isMarked) {
+    if (entry->key != NULL && !IS_MARKED(&entry->key->obj)) {
       tableDelete(table, entry->key);
     }
   }
@@ -20,7 +20,7 @@ void freeTable(Table* table);
 bool tableGet(Table* table, ObjString* key, Value* value);
 bool tableSet(Table* table, ObjString* key, Value value);
 bool tableDelete(Table* table, ObjString* key);
-void tableAddAll(Table* from, Table* to);
+void tableShrink(Table* table);
 ObjString* tableFindString(Table* table, const char* chars,
                            int length, uint32_t hash);
 
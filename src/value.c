@@ -1,6 +1,7 @@
 #include "clox_stdio.h"
 #include <string.h>
 
+#include "dtoa.h"
 #include "object.h"
 #include "memory.h"
 #include "value.h"
@@ -13,9 +14,9 @@ void initValueArray(ValueArray* array) {
 void writeValueArray(ValueArray* array, Value value) {
   if (array->capacity < array->count + 1) {
     int oldCapacity = array->capacity;
-    array->capacity = GROW_CAPACITY(oldCapacity);
     array->values = GROW_ARRAY(Value, array->values,
-                               oldCapacity, array->capacity);
+                               oldCapacity, GROW_CAPACITY(oldCapacity));
+    array->capacity = GROW_CAPACITY(oldCapacity);
   }
   
   array->values[array->count] = value;
@@ -25,6 +26,11 @@ void freeValueArray(ValueArray* array) {
   FREE_ARRAY(Value, array->values, array->capacity);
   initValueArray(array);
 }
+static void printNumber(double number) {
+  char buffer[NUMBER_BUFFER_SIZE];
+  formatNumber(number, buffer);
+  printf("%s", buffer);
+}
 void printValue(Value value) {
 #ifdef NAN_BOXING
   if (IS_BOOL(value)) {
@@ -32,7 +38,7 @@ void printValue(Value value) {
   } else if (IS_NIL(value)) {
     printf("nil");
   } else if (IS_NUMBER(value)) {
-    printf("%.10g", AS_NUMBER(value));
+    printNumber(AS_NUMBER(value));
   } else if (IS_OBJ(value)) {
     printObject(value);
   }
@@ -42,7 +48,7 @@ void printValue(Value value) {
       printf(AS_BOOL(value) ? "true" : "false");
       break;
     case VAL_NIL: printf("nil"); break;
-    case VAL_NUMBER: printf("%.10g", AS_NUMBER(value)); break;
+    case VAL_NUMBER: printNumber(AS_NUMBER(value)); break;
     case VAL_OBJ: printObject(value); break;
   }
 #endif
@@ -52,14 +58,19 @@ bool valuesEqual(Value a, Value b) {
   if (IS_NUMBER(a) && IS_NUMBER(b)) {
     return AS_NUMBER(a) == AS_NUMBER(b);
   }
-  return a == b;
+  if (a == b) return true;
+  return IS_STRING(a) && IS_STRING(b) &&
+         stringsEqual(AS_STRING(a), AS_STRING(b));
 #else
   if (a.type != b.type) return false;
   switch (a.type) {
     case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
     case VAL_NIL:    return true;
     case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-    case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
+    case VAL_OBJ:
+      if (AS_OBJ(a) == AS_OBJ(b)) return true;
+      return IS_STRING(a) && IS_STRING(b) &&
+             stringsEqual(AS_STRING(a), AS_STRING(b));
     default:         return false; // Unreachable.
   }
 #endif
@@ -1,13 +1,19 @@
 #include "clox_stdio.h"
 #include "clox_gfx.h"
+#include <float.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "dtoa.h"
+#include "image.h"
+#include "jit.h"
 #include "object.h"
 #include "memory.h"
+#include "snapshot.h"
 #include "vm.h"
 
 VM vm; // [one]
@@ -23,18 +29,20 @@ void runtimeError(const char* format, ...) {
   va_end(args);
   fputs("\n", stderr);
 
+#ifndef CLOX_STRIP_DEBUG_INFO
   for (int i = vm.frameCount - 1; i >= 0; i--) {
     CallFrame* frame = &vm.frames[i];
     ObjFunction* function = frame->closure->function;
     size_t instruction = frame->ip - function->chunk.code - 1;
     fprintf(stderr, "[line %d] in ", // [minus]
-            function->chunk.lines[instruction]);
+            getLine(&function->chunk, (int)instruction));
     if (function->name == NULL) {
       fprintf(stderr, "script\n");
     } else {
       fprintf(stderr, "%s()\n", function->name->chars);
     }
   }
+#endif
 
   resetStack();
 }
@@ -84,12 +92,41 @@ GFX_DEFINE_STR(printStrLn)
 GFX_DEFINE(printInt, 2)
 GFX_DEFINE(printFloat, 2)
 
+// Appends the text of a string, number, boolean or nil, as tostring()
+// would give it.
+static bool appendValueToBuilder(ObjBuilder* builder, Value value) {
+  char buffer[NUMBER_BUFFER_SIZE];
+  if (IS_STRING(value)) {
+    appendToBuilder(builder, stringChars(AS_STRING(value)),
+                    AS_STRING(value)->length);
+    return true;
+  } else if (IS_BOOL(value)) {
+    snprintf(buffer, sizeof(buffer), AS_BOOL(value) ? "true" : "false");
+  } else if (IS_NIL(value)) {
+    snprintf(buffer, sizeof(buffer), "nil");
+  } else if (IS_NUMBER(value)) {
+    formatNumber(AS_NUMBER(value), buffer);
+  } else {
+    return false;
+  }
+  appendToBuilder(builder, buffer, (int)strlen(buffer));
+  return true;
+}
+
 static Value appendNative(int argCount, Value* args) {
-  // Append a value to the end of a list increasing the list's length by 1
-  if (argCount != 2 || !IS_LIST(args[0])) {
+  // Append a value to the end of a list increasing the list's length by 1,
+  // or the text of a value to the end of a string builder
+  if (argCount != 2 || (!IS_LIST(args[0]) && !IS_BUILDER(args[0]))) {
     runtimeError("Bad call to append().");
     return ERR_VAL;
   }
+  if (IS_BUILDER(args[0])) {
+    if (!appendValueToBuilder(AS_BUILDER(args[0]), args[1])) {
+      runtimeError("Cannot convert this type to a string.");
+      return ERR_VAL;
+    }
+    return NIL_VAL;
+  }
   ObjList* list = AS_LIST(args[0]);
   Value item = args[1];
   appendToList(list, item);
@@ -114,8 +151,189 @@ static Value deleteNative(int argCount, Value* args) {
   deleteFromList(list, index);
   return NIL_VAL;
 }
+static Value gcStepTimeNative(int argCount, Value* args) {
+  // Longest pause in microseconds of each step of a major collection,
+  // or 0 to stop the program until it is complete
+  if (argCount != 1 || !IS_NUMBER(args[0]) || AS_NUMBER(args[0]) < 0) {
+    runtimeError("Bad call to gcStepTime().");
+    return ERR_VAL;
+  }
+  vm.gcStepMicros = (unsigned long)AS_NUMBER(args[0]);
+  return NIL_VAL;
+}
+
+static Value gcPausesNative(int argCount, Value* args) {
+  // Print the distribution of garbage collector pause times so far
+  if (argCount != 0) {
+    runtimeError("Bad call to gcPauses().");
+    return ERR_VAL;
+  }
+  printGcPauses();
+  return NIL_VAL;
+}
+
+static Value gcNative(int argCount, Value* args) {
+  // Complete a collection of the whole heap, or with an argument do the
+  // next step of collection for up to that many microseconds
+  if (argCount > 1 || (argCount == 1 &&
+      (!IS_NUMBER(args[0]) || AS_NUMBER(args[0]) < 0))) {
+    runtimeError("Bad call to gc().");
+    return ERR_VAL;
+  }
+  if (argCount == 0) {
+    collectAllGarbage();
+  } else {
+    collectGarbageStep((unsigned long)AS_NUMBER(args[0]));
+  }
+  return NIL_VAL;
+}
+
+static Value gcThresholdsNative(int argCount, Value* args) {
+  // Bytes allocated between minor collections, heap size at which the
+  // next major collection starts and growth allowed after each one
+  if (argCount != 3 || !IS_NUMBER(args[0]) || !IS_NUMBER(args[1]) ||
+      !IS_NUMBER(args[2]) || AS_NUMBER(args[0]) < 1 ||
+      AS_NUMBER(args[1]) < 0 || AS_NUMBER(args[2]) < 1) {
+    runtimeError("Bad call to gcThresholds().");
+    return ERR_VAL;
+  }
+  setGcThresholds((size_t)AS_NUMBER(args[0]), (size_t)AS_NUMBER(args[1]),
+                  AS_NUMBER(args[2]));
+  return NIL_VAL;
+}
+
+#ifdef CLOX_PARALLEL_GC
+static Value gcThreadsNative(int argCount, Value* args) {
+  // Number of threads to mark with, including this one, returning the
+  // number in use
+  if (argCount > 1 || (argCount == 1 && !IS_NUMBER(args[0]))) {
+    runtimeError("Bad call to gcThreads().");
+    return ERR_VAL;
+  }
+  int count = argCount == 1 ? (int)AS_NUMBER(args[0]) : 0;
+  return NUMBER_VAL(setGcThreads(count));
+}
+#endif
+
+static void setStatsField(ObjInstance* stats, const char* name,
+                          double value) {
+  push(OBJ_VAL(copyString(name, (int)strlen(name))));
+  tableSet(&stats->fields, AS_STRING(vm.stackTop[-1]), NUMBER_VAL(value));
+  WRITE_BARRIER(stats, vm.stackTop[-1]);
+  pop();
+}
+
+static Value heapStatsNative(int argCount, Value* args) {
+  // Return an instance with fields for memory use, the number of live
+  // objects of each type and collector activity so far
+  static const char* countNames[OBJ_TYPE_COUNT] = {
+    "boundMethods", "classes", "closures", "functions", "instances",
+    "natives", "strings", "lists", "builders", "upvalues"
+  };
+
+  if (argCount != 0) {
+    runtimeError("Bad call to heapStats().");
+    return ERR_VAL;
+  }
+
+  // Taken before allocating the result so that it is not counted.
+  size_t bytesAllocated = vm.bytesAllocated;
+  GcStats gcStats = vm.gcStats;
+
+  push(OBJ_VAL(copyString("HeapStats", 9)));
+  push(OBJ_VAL(newClass(AS_STRING(vm.stackTop[-1]))));
+  ObjInstance* stats = newInstance(AS_CLASS(vm.stackTop[-1]));
+  push(OBJ_VAL(stats));
+
+  setStatsField(stats, "bytesAllocated", bytesAllocated);
+  for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+    setStatsField(stats, countNames[i], gcStats.objectCounts[i]);
+  }
+  setStatsField(stats, "minorCollections", gcStats.minorCollections);
+  setStatsField(stats, "majorCollections", gcStats.majorCollections);
+  setStatsField(stats, "pauses", vm.gcPauses.count);
+  setStatsField(stats, "pauseTotal", vm.gcPauses.total);
+  setStatsField(stats, "pauseLongest", vm.gcPauses.longest);
+
+  pop();
+  pop();
+  pop();
+  return OBJ_VAL(stats);
+}
+
+static Value heapLimitNative(int argCount, Value* args) {
+  // Most bytes the heap may grow to before allocation fails with an
+  // out of memory error, or 0 for no limit
+  if (argCount != 1 || !IS_NUMBER(args[0]) || AS_NUMBER(args[0]) < 0) {
+    runtimeError("Bad call to heapLimit().");
+    return ERR_VAL;
+  }
+  vm.heapLimit = (size_t)AS_NUMBER(args[0]);
+  vm.heapReserve = 0;
+  return NIL_VAL;
+}
+
+static Value heapSnapshotNative(int argCount, Value* args) {
+  // Print every live object and what refers to it, for the host tool in
+  // extras/heap_snapshot
+  if (argCount != 0) {
+    runtimeError("Bad call to heapSnapshot().");
+    return ERR_VAL;
+  }
+  printHeapSnapshot();
+  return NIL_VAL;
+}
+
+static Value stringBuilderNative(int argCount, Value* args) {
+  // Return an empty builder for a string too long to build with +
+  if (argCount != 0) {
+    runtimeError("Bad call to stringBuilder().");
+    return ERR_VAL;
+  }
+  return OBJ_VAL(newBuilder());
+}
+
+// With a fixed number of decimal places every digit of the integer part
+// is written, so the buffer must hold the largest double in full, with
+// its sign, point and places.
+#define MAX_DECIMAL_PLACES 15
+#define FIXED_NUMBER_BUFFER_SIZE \
+    (DBL_MAX_10_EXP + 1 + 2 + MAX_DECIMAL_PLACES + 1)
+
+static Value appendNumberNative(int argCount, Value* args) {
+  // Append a number to a string builder with the given number of
+  // decimal places, or as tostring() would give it
+  if (argCount < 2 || argCount > 3 || !IS_BUILDER(args[0]) ||
+      !IS_NUMBER(args[1]) ||
+      (argCount == 3 && (!IS_NUMBER(args[2]) || AS_NUMBER(args[2]) < 0 ||
+                         AS_NUMBER(args[2]) > MAX_DECIMAL_PLACES))) {
+    runtimeError("Bad call to appendNumber().");
+    return ERR_VAL;
+  }
+  char buffer[FIXED_NUMBER_BUFFER_SIZE];
+  if (argCount == 3) {
+    snprintf(buffer, sizeof(buffer), "%.*f", (int)AS_NUMBER(args[2]),
+             AS_NUMBER(args[1]));
+  } else {
+    formatNumber(AS_NUMBER(args[1]), buffer);
+  }
+  appendToBuilder(AS_BUILDER(args[0]), buffer, (int)strlen(buffer));
+  return NIL_VAL;
+}
+
+static Value resetNative(int argCount, Value* args) {
+  // Empty a string builder, keeping its memory to build the next string
+  if (argCount != 1 || !IS_BUILDER(args[0])) {
+    runtimeError("Bad call to reset().");
+    return ERR_VAL;
+  }
+  AS_BUILDER(args[0])->length = 0;
+  return NIL_VAL;
+}
+
 static Value lengthNative(int argCount, Value* args) {
-  if (argCount != 1 || (!IS_STRING(args[0]) && !IS_LIST(args[0]))) {
+  if (argCount != 1 || (!IS_STRING(args[0]) && !IS_LIST(args[0]) &&
+                        !IS_BUILDER(args[0]))) {
     runtimeError("Bad call to length().");
     return ERR_VAL;
   }
@@ -128,6 +346,9 @@ static Value lengthNative(int argCount, Value* args) {
     ObjList* list = AS_LIST(args[0]);
     length = list->count;
   }
+  else if (IS_BUILDER(args[0])) {
+    length = AS_BUILDER(args[0])->length;
+  }
   return NUMBER_VAL(length);
 }
 static Value tostringNative(int argCount, Value* args) {
@@ -135,14 +356,19 @@ static Value tostringNative(int argCount, Value* args) {
     runtimeError("Bad call to tostring().");
     return ERR_VAL;
   }
-  char buffer[16];
+  if (IS_BUILDER(args[0])) {
+    ObjBuilder* builder = AS_BUILDER(args[0]);
+    if (builder->length == 0) return OBJ_VAL(newString("", 0));
+    return OBJ_VAL(newString(builder->chars, builder->length));
+  }
+  char buffer[NUMBER_BUFFER_SIZE];
 #ifdef NAN_BOXING
   if (IS_BOOL(args[0])) {
     snprintf(buffer, sizeof(buffer), AS_BOOL(args[0]) ? "true" : "false");
   } else if (IS_NIL(args[0])) {
     snprintf(buffer, sizeof(buffer), "nil");
   } else if (IS_NUMBER(args[0])) {
-    snprintf(buffer, sizeof(buffer), "%g", AS_NUMBER(args[0]));
+    formatNumber(AS_NUMBER(args[0]), buffer);
   } else if (IS_OBJ(args[0]) && IS_STRING(args[0])) {
     return args[0];
   } else {
@@ -155,14 +381,14 @@ static Value tostringNative(int argCount, Value* args) {
       snprintf(buffer, sizeof(buffer), AS_BOOL(args[0]) ? "true" : "false");
       break;
     case VAL_NIL: snprintf(buffer, sizeof(buffer), "nil"); break;
-    case VAL_NUMBER: snprintf(buffer, sizeof(buffer), "%g", AS_NUMBER(args[0])); break;
+    case VAL_NUMBER: formatNumber(AS_NUMBER(args[0]), buffer); break;
     case VAL_OBJ: if (IS_STRING(args[0])) { return args[0]; } else {
       runtimeError("Cannot convert this type to a string.");
     return ERR_VAL;
      }
   }
 #endif
-  return OBJ_VAL(copyString(buffer, (int)strlen(buffer)));
+  return OBJ_VAL(newString(buffer, (int)strlen(buffer)));
 }
 static Value substringNative(int argCount, Value* args) {
   if (argCount != 3 || !IS_STRING(args[0]) || !IS_NUMBER(args[1]) || !IS_NUMBER(args[2])) {
@@ -175,26 +401,327 @@ static Value substringNative(int argCount, Value* args) {
     runtimeError("Bad index(es) for substring().");
     return ERR_VAL;
   }
-  return OBJ_VAL(copyString(str->chars + start, end - start + 1));
+  return OBJ_VAL(newSubstring(str, start, end - start + 1));
+}
+
+// Index of the first occurrence of needle in haystack at or after from,
+// or -1. Candidates are found with memchr(), which C libraries scan a
+// word or more at a time.
+static int findChars(const char* haystack, int length, const char* needle,
+                     int needleLength, int from) {
+  if (from > length - needleLength) return -1;
+  if (needleLength == 0) return from;
+
+  const char* start = haystack + from;
+  const char* end = haystack + length - needleLength + 1;
+  while (start < end) {
+    start = (const char*)memchr(start, needle[0], end - start);
+    if (start == NULL) return -1;
+    if (memcmp(start, needle, needleLength) == 0) {
+      return (int)(start - haystack);
+    }
+    start++;
+  }
+  return -1;
+}
+static int countChars(ObjString* string, ObjString* needle) {
+  int count = 0;
+  int index = 0;
+  while ((index = findChars(stringChars(string), string->length,
+                            stringChars(needle), needle->length,
+                            index)) != -1) {
+    count++;
+    index += needle->length;
+  }
+  return count;
+}
+static bool isSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static Value indexOfNative(int argCount, Value* args) {
+  // Index of the first occurrence of a string in another, optionally
+  // starting from an index, or -1 if there is none
+  if (argCount < 2 || argCount > 3 || !IS_STRING(args[0]) ||
+      !IS_STRING(args[1]) || (argCount == 3 && !IS_NUMBER(args[2]))) {
+    runtimeError("Bad call to indexOf().");
+    return ERR_VAL;
+  }
+  ObjString* string = AS_STRING(args[0]);
+  ObjString* needle = AS_STRING(args[1]);
+  int from = argCount == 3 ? (int)AS_NUMBER(args[2]) : 0;
+  if (from < 0) from = 0;
+  return NUMBER_VAL(findChars(stringChars(string), string->length,
+                              stringChars(needle), needle->length, from));
+}
+
+static Value startsWithNative(int argCount, Value* args) {
+  if (argCount != 2 || !IS_STRING(args[0]) || !IS_STRING(args[1])) {
+    runtimeError("Bad call to startsWith().");
+    return ERR_VAL;
+  }
+  ObjString* string = AS_STRING(args[0]);
+  ObjString* prefix = AS_STRING(args[1]);
+  return BOOL_VAL(prefix->length <= string->length &&
+                  memcmp(stringChars(string), stringChars(prefix),
+                         prefix->length) == 0);
+}
+
+static Value endsWithNative(int argCount, Value* args) {
+  if (argCount != 2 || !IS_STRING(args[0]) || !IS_STRING(args[1])) {
+    runtimeError("Bad call to endsWith().");
+    return ERR_VAL;
+  }
+  ObjString* string = AS_STRING(args[0]);
+  ObjString* suffix = AS_STRING(args[1]);
+  return BOOL_VAL(suffix->length <= string->length &&
+                  memcmp(stringChars(string) + string->length -
+                         suffix->length, stringChars(suffix),
+                         suffix->length) == 0);
+}
+
+static Value splitNative(int argCount, Value* args) {
+  // Split a string into a list of the pieces between each separator, or
+  // into single characters if the separator is empty
+  if (argCount != 2 || !IS_STRING(args[0]) || !IS_STRING(args[1])) {
+    runtimeError("Bad call to split().");
+    return ERR_VAL;
+  }
+  ObjString* string = AS_STRING(args[0]);
+  ObjString* separator = AS_STRING(args[1]);
+  int pieces = separator->length == 0 ? string->length
+                                      : countChars(string, separator) + 1;
+
+  ObjList* list = newList();
+  push(OBJ_VAL(list));
+  list->items = GROW_ARRAY(Value, NULL, 0, pieces);
+  list->capacity = pieces;
+
+  int start = 0;
+  for (int i = 0; i < pieces; i++) {
+    int end = separator->length == 0 ? start + 1
+        : findChars(stringChars(string), string->length,
+                    stringChars(separator), separator->length, start);
+    if (end == -1) end = string->length;
+    appendToList(list, OBJ_VAL(newSubstring(string, start, end - start)));
+    start = end + separator->length;
+  }
+  return pop();
+}
+
+static Value joinNative(int argCount, Value* args) {
+  // Join a list of strings into one, with an optional separator between
+  // each
+  if (argCount < 1 || argCount > 2 || !IS_LIST(args[0]) ||
+      (argCount == 2 && !IS_STRING(args[1]))) {
+    runtimeError("Bad call to join().");
+    return ERR_VAL;
+  }
+  ObjList* list = AS_LIST(args[0]);
+  ObjString* separator = argCount == 2 ? AS_STRING(args[1]) : NULL;
+  int separatorLength = separator != NULL ? separator->length : 0;
+
+  int length = 0;
+  for (int i = 0; i < list->count; i++) {
+    if (!IS_STRING(list->items[i])) {
+      runtimeError("join() needs a list of strings.");
+      return ERR_VAL;
+    }
+    if (i > 0) length += separatorLength;
+    length += AS_STRING(list->items[i])->length;
+  }
+
+  ObjString* result = allocateString(length);
+  char* next = result->chars;
+  for (int i = 0; i < list->count; i++) {
+    if (i > 0 && separator != NULL) {
+      memcpy(next, stringChars(separator), separatorLength);
+      next += separatorLength;
+    }
+    ObjString* item = AS_STRING(list->items[i]);
+    memcpy(next, stringChars(item), item->length);
+    next += item->length;
+  }
+  return OBJ_VAL(result);
+}
+
+static Value replaceNative(int argCount, Value* args) {
+  // Replace every occurrence of a string with another
+  if (argCount != 3 || !IS_STRING(args[0]) || !IS_STRING(args[1]) ||
+      !IS_STRING(args[2]) || AS_STRING(args[1])->length == 0) {
+    runtimeError("Bad call to replace().");
+    return ERR_VAL;
+  }
+  ObjString* string = AS_STRING(args[0]);
+  ObjString* from = AS_STRING(args[1]);
+  ObjString* to = AS_STRING(args[2]);
+
+  int count = countChars(string, from);
+  if (count == 0) return args[0];
+
+  ObjString* result = allocateString(string->length +
+                                     count * (to->length - from->length));
+  const char* chars = stringChars(string);
+  char* next = result->chars;
+  int start = 0;
+  for (int i = 0; i < count; i++) {
+    int end = findChars(chars, string->length, stringChars(from),
+                        from->length, start);
+    memcpy(next, chars + start, end - start);
+    next += end - start;
+    memcpy(next, stringChars(to), to->length);
+    next += to->length;
+    start = end + from->length;
+  }
+  memcpy(next, chars + start, string->length - start);
+  return OBJ_VAL(result);
+}
+
+static Value trimNative(int argCount, Value* args) {
+  // Remove spaces, tabs and line breaks from both ends of a string
+  if (argCount != 1 || !IS_STRING(args[0])) {
+    runtimeError("Bad call to trim().");
+    return ERR_VAL;
+  }
+  ObjString* string = AS_STRING(args[0]);
+  const char* chars = stringChars(string);
+  int start = 0;
+  int end = string->length;
+  while (start < end && isSpace(chars[start])) start++;
+  while (end > start && isSpace(chars[end - 1])) end--;
+  if (start == 0 && end == string->length) return args[0];
+  return OBJ_VAL(newSubstring(string, start, end - start));
+}
+
+static Value toNumberNative(int argCount, Value* args) {
+  // The number a string holds, ignoring spaces around it, or nil if it
+  // doesn't hold one
+  if (argCount != 1 || !IS_STRING(args[0])) {
+    runtimeError("Bad call to toNumber().");
+    return ERR_VAL;
+  }
+  const char* chars = stringCString(AS_STRING(args[0]));
+  while (isSpace(*chars)) chars++;
+
+  // Numbers are read as they would be written in a script, which
+  // leaves out "inf", "nan" and exponents, with a minus sign allowed.
+  bool negative = *chars == '-';
+  if (negative) chars++;
+  int length = scanNumber(chars);
+  if (length == 0) return NIL_VAL;
+
+  const char* end = chars + length;
+  while (isSpace(*end)) end++;
+  if (*end != '\0') return NIL_VAL;
+
+  double number = parseNumber(chars, length);
+  return NUMBER_VAL(negative ? -number : number);
 }
-static void defineNative(const char* name, NativeFn function) {
+
+static Value changeCase(Value value, char from, char to) {
+  ObjString* string = AS_STRING(value);
+  ObjString* result = allocateString(string->length);
+  const char* chars = stringChars(string);
+  for (int i = 0; i < string->length; i++) {
+    char c = chars[i];
+    result->chars[i] = c >= from && c < from + 26 ? c - from + to : c;
+  }
+  return OBJ_VAL(result);
+}
+
+static Value upperNative(int argCount, Value* args) {
+  if (argCount != 1 || !IS_STRING(args[0])) {
+    runtimeError("Bad call to upper().");
+    return ERR_VAL;
+  }
+  return changeCase(args[0], 'a', 'A');
+}
+
+static Value lowerNative(int argCount, Value* args) {
+  if (argCount != 1 || !IS_STRING(args[0])) {
+    runtimeError("Bad call to lower().");
+    return ERR_VAL;
+  }
+  return changeCase(args[0], 'A', 'a');
+}
+
+static Value charCodeNative(int argCount, Value* args) {
+  // Code of the character at an index in a string, the first if none
+  // is given
+  if (argCount < 1 || argCount > 2 || !IS_STRING(args[0]) ||
+      (argCount == 2 && !IS_NUMBER(args[1]))) {
+    runtimeError("Bad call to charCode().");
+    return ERR_VAL;
+  }
+  ObjString* string = AS_STRING(args[0]);
+  int index = argCount == 2 ? (int)AS_NUMBER(args[1]) : 0;
+  if (index < 0 || index >= string->length) {
+    runtimeError("Index %d is not valid.", index);
+    return ERR_VAL;
+  }
+  return NUMBER_VAL((uint8_t)stringChars(string)[index]);
+}
+
+static Value fromCharCodeNative(int argCount, Value* args) {
+  // String of the characters with the given codes
+  for (int i = 0; i < argCount; i++) {
+    if (!IS_NUMBER(args[i]) || AS_NUMBER(args[i]) < 0 ||
+        AS_NUMBER(args[i]) > 255) {
+      runtimeError("Bad call to fromCharCode().");
+      return ERR_VAL;
+    }
+  }
+  ObjString* result = allocateString(argCount);
+  for (int i = 0; i < argCount; i++) {
+    result->chars[i] = (char)(int)AS_NUMBER(args[i]);
+  }
+  return OBJ_VAL(result);
+}
+static ObjNative* defineNative(const char* name, NativeFn function) {
   push(OBJ_VAL(copyString(name, (int)strlen(name))));
   push(OBJ_VAL(newNative(function)));
   tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+  ObjNative* native = (ObjNative*)AS_OBJ(vm.stack[1]);
   pop();
   pop();
+  return native;
+}
+// A pure native always returns the same value for the same numeric
+// arguments and has no side effects, so the compiler may call it
+// itself when every argument is a constant.
+static void definePureNative(const char* name, NativeFn function,
+                             int arity) {
+  ObjNative* native = defineNative(name, function);
+  native->arity = arity;
+  native->isPure = true;
 }
 
 void initVM() {
   resetStack();
   vm.objects = NULL;
+  vm.oldObjects = NULL;
   vm.bytesAllocated = 0;
-  vm.nextGC = 1024 * 1024;
+  vm.heapLimit = 0;
+  vm.heapReserve = 0;
+  vm.outOfMemory = NULL;
+  vm.foldPureCalls = true;
+  vm.gcPhase = GC_IDLE;
+  setGcThresholds(GC_NURSERY_SIZE, GC_INITIAL_HEAP, GC_HEAP_GROW_FACTOR);
+  vm.markEpoch = true;
+  vm.gcStepMicros = 1000;
+  memset(&vm.gcPauses, 0, sizeof(GcPauses));
+  memset(&vm.gcStats, 0, sizeof(GcStats));
+  vm.unsweptYoung = NULL;
+  vm.unsweptOld = NULL;
 
   vm.grayCount = 0;
   vm.grayCapacity = 0;
   vm.grayStack = NULL;
 
+  vm.rememberedCount = 0;
+  vm.rememberedCapacity = 0;
+  vm.rememberedSet = NULL;
+
   initTable(&vm.globals);
   initTable(&vm.strings);
 
@@ -214,16 +741,17 @@ void initVM() {
   GFX_DECLARE(analogRead);
   GFX_DECLARE(analogReference);
   GFX_DECLARE(beginDraw);
-  GFX_DECLARE(bit);
-  GFX_DECLARE(bitClear);
-  GFX_DECLARE(bitRead);
-  GFX_DECLARE(bitSet);
-  GFX_DECLARE(highByte);
-  GFX_DECLARE(lowByte);
   GFX_DECLARE(isRotated);
+  // Pure natives, evaluated by the compiler for constant arguments.
+  GFX_DECLARE_PURE(bit, 1);
+  GFX_DECLARE_PURE(bitClear, 2);
+  GFX_DECLARE_PURE(bitRead, 2);
+  GFX_DECLARE_PURE(bitSet, 2);
+  GFX_DECLARE_PURE(highByte, 1);
+  GFX_DECLARE_PURE(lowByte, 1);
+  GFX_DECLARE_PURE(width, 0);
+  GFX_DECLARE_PURE(height, 0);
   GFX_DECLARE(endDraw);
-  GFX_DECLARE(width);
-  GFX_DECLARE(height);
   GFX_DECLARE(fill);
   GFX_DECLARE(noFill);
   GFX_DECLARE(stroke);
@@ -251,6 +779,31 @@ void initVM() {
   defineNative("length", lengthNative);
   defineNative("tostring", tostringNative);
   defineNative("substring", substringNative);
+  defineNative("indexOf", indexOfNative);
+  defineNative("startsWith", startsWithNative);
+  defineNative("endsWith", endsWithNative);
+  defineNative("split", splitNative);
+  defineNative("join", joinNative);
+  defineNative("replace", replaceNative);
+  defineNative("trim", trimNative);
+  defineNative("toNumber", toNumberNative);
+  defineNative("upper", upperNative);
+  defineNative("lower", lowerNative);
+  defineNative("charCode", charCodeNative);
+  defineNative("fromCharCode", fromCharCodeNative);
+  defineNative("stringBuilder", stringBuilderNative);
+  defineNative("appendNumber", appendNumberNative);
+  defineNative("reset", resetNative);
+  defineNative("gcStepTime", gcStepTimeNative);
+  defineNative("gcPauses", gcPausesNative);
+  defineNative("gc", gcNative);
+  defineNative("gcThresholds", gcThresholdsNative);
+#ifdef CLOX_PARALLEL_GC
+  defineNative("gcThreads", gcThreadsNative);
+#endif
+  defineNative("heapStats", heapStatsNative);
+  defineNative("heapSnapshot", heapSnapshotNative);
+  defineNative("heapLimit", heapLimitNative);
 }
 
 void freeVM() {
@@ -270,6 +823,16 @@ Value pop() {
 static Value peek(int distance) {
   return vm.stackTop[-1 - distance];
 }
+#ifdef CLOX_JIT
+// Compiles a function to machine code once it has been called or has
+// looped JIT_THRESHOLD times.
+static void warmUp(ObjFunction* function) {
+  if (function->compiled == NULL && function->hotness < JIT_THRESHOLD &&
+      ++function->hotness == JIT_THRESHOLD) {
+    jitCompile(function);
+  }
+}
+#endif
 static bool call(ObjClosure* closure, int argCount) {
   if (argCount != closure->function->arity) {
     runtimeError("Expected %d arguments but got %d.",
@@ -286,6 +849,9 @@ static bool call(ObjClosure* closure, int argCount) {
   frame->closure = closure;
   frame->ip = closure->function->chunk.code;
   frame->slots = vm.stackTop - argCount - 1;
+#ifdef CLOX_JIT
+  warmUp(closure->function);
+#endif
   return true;
 }
 static bool callValue(Value callee, int argCount) {
@@ -398,6 +964,7 @@ static void closeUpvalues(Value* last) {
     ObjUpvalue* upvalue = vm.openUpvalues;
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
+    WRITE_BARRIER(upvalue, upvalue->closed);
     vm.openUpvalues = upvalue->next;
   }
 }
@@ -405,113 +972,239 @@ static void defineMethod(ObjString* name) {
   Value method = peek(0);
   ObjClass* klass = AS_CLASS(peek(1));
   tableSet(&klass->methods, name, method);
+  WRITE_BARRIER(klass, OBJ_VAL(name));
+  WRITE_BARRIER(klass, method);
   pop();
 }
+// The subclass may already be marked by the time its superclass's
+// methods are copied into it, if a collection ran while it was stored
+// in its variable, so each one copied is barriered like defineMethod().
+static void inheritMethods(ObjClass* superclass, ObjClass* subclass) {
+  Table* methods = &superclass->methods;
+  for (int i = 0; i < methods->capacity; i++) {
+    Entry* entry = &methods->entries[i];
+    if (entry->key == NULL) continue;
+
+    tableSet(&subclass->methods, entry->key, entry->value);
+    WRITE_BARRIER(subclass, OBJ_VAL(entry->key));
+    WRITE_BARRIER(subclass, entry->value);
+  }
+}
 static bool isFalsey(Value value) {
   return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 static void concatenate() {
-  ObjString* b = AS_STRING(peek(0));
+  ObjString* b = AS_STRING(vm.stackTop[-1]);
   ObjString* a = AS_STRING(peek(1));
 
-  int length = a->length + b->length;
-  char* chars = ALLOCATE(char, length + 1);
-  memcpy(chars, a->chars, a->length);
-  memcpy(chars + a->length, b->chars, b->length);
-  chars[length] = '\0';
+  ObjString* result = allocateString(a->length + b->length);
+  memcpy(result->chars, stringChars(a), a->length);
+  memcpy(result->chars + a->length, stringChars(b), b->length);
 
-  ObjString* result = takeString(chars, length);
   pop();
   pop();
   push(OBJ_VAL(result));
 }
 static InterpretResult run() {
   CallFrame* frame = &vm.frames[vm.frameCount - 1];
+  register uint8_t* ip = frame->ip;
+#ifdef CLOX_COMPILED_CODE
+  CompiledCode compiled = frame->closure->function->compiled;
+#endif
 
-#define READ_BYTE() (*frame->ip++)
+#define READ_BYTE() (*ip++)
 
 #define READ_SHORT() \
-    (frame->ip += 2, \
-    (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+    (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
 
 #define READ_CONSTANT() \
     (frame->closure->function->chunk.constants.values[READ_BYTE()])
 
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+
+// The instruction pointer lives in a local so the compiler can keep it
+// in a register. It must be written back before anything that reads
+// frame->ip (runtimeError(), calls), including any allocation, which
+// reports running out of memory with a runtime error, and reloaded
+// when the frame changes.
+#define SAVE_IP() (frame->ip = ip)
+
+#ifdef CLOX_COMPILED_CODE
+#define LOAD_COMPILED() (compiled = frame->closure->function->compiled)
+
+// A compiled function runs until an instruction it leaves to the
+// interpreter, which is run before going back to the compiled code.
+#define RUN_COMPILED() \
+    do { \
+      if (compiled != NULL) { \
+        SAVE_IP(); \
+        compiled(frame); \
+        ip = frame->ip; \
+      } \
+    } while (false)
+#else
+#define LOAD_COMPILED() ((void)0)
+#define RUN_COMPILED() do { } while (false)
+#endif
+
+#define LOAD_FRAME() \
+    do { \
+      frame = &vm.frames[vm.frameCount - 1]; \
+      ip = frame->ip; \
+      LOAD_COMPILED(); \
+    } while (false)
+
+#define RUNTIME_ERROR(...) \
+    do { \
+      SAVE_IP(); \
+      runtimeError(__VA_ARGS__); \
+      return INTERPRET_RUNTIME_ERROR; \
+    } while (false)
+
 #define BINARY_OP(valueType, op) \
     do { \
       if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-        runtimeError("Operands must be numbers."); \
-        return INTERPRET_RUNTIME_ERROR; \
+        RUNTIME_ERROR("Operands must be numbers."); \
       } \
       double b = AS_NUMBER(pop()); \
       double a = AS_NUMBER(pop()); \
       push(valueType(a op b)); \
     } while (false)
 
-  for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
-    printf("          ");
-    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-      printf("[ ");
-      printValue(*slot);
-      printf(" ]");
-    }
-    printf("\n");
-    disassembleInstruction(&frame->closure->function->chunk,
-        (int)(frame->ip - frame->closure->function->chunk.code));
+#define TRACE_EXECUTION() \
+    do { \
+      printf("          "); \
+      for (Value* slot = vm.stack; slot < vm.stackTop; slot++) { \
+        printf("[ "); \
+        printValue(*slot); \
+        printf(" ]"); \
+      } \
+      printf("\n"); \
+      disassembleInstruction(&frame->closure->function->chunk, \
+          (int)(ip - frame->closure->function->chunk.code)); \
+    } while (false)
+#else
+#define TRACE_EXECUTION() do { } while (false)
 #endif
 
-    uint8_t instruction;
-    switch (instruction = READ_BYTE()) {
-      case OP_CONSTANT: {
+#ifdef COMPUTED_GOTO
+  // Each handler jumps straight to the next one through this table
+  // instead of returning to a shared switch, which gives the branch
+  // predictor one indirect jump per opcode to learn.
+  static void* dispatchTable[] = {
+    [OP_CONSTANT] = &&op_OP_CONSTANT,
+    [OP_NIL] = &&op_OP_NIL,
+    [OP_TRUE] = &&op_OP_TRUE,
+    [OP_FALSE] = &&op_OP_FALSE,
+    [OP_POP] = &&op_OP_POP,
+    [OP_GET_LOCAL] = &&op_OP_GET_LOCAL,
+    [OP_SET_LOCAL] = &&op_OP_SET_LOCAL,
+    [OP_GET_GLOBAL] = &&op_OP_GET_GLOBAL,
+    [OP_DEFINE_GLOBAL] = &&op_OP_DEFINE_GLOBAL,
+    [OP_SET_GLOBAL] = &&op_OP_SET_GLOBAL,
+    [OP_BUILD_LIST] = &&op_OP_BUILD_LIST,
+    [OP_INDEX_SUBSCR] = &&op_OP_INDEX_SUBSCR,
+    [OP_STORE_SUBSCR] = &&op_OP_STORE_SUBSCR,
+    [OP_GET_UPVALUE] = &&op_OP_GET_UPVALUE,
+    [OP_SET_UPVALUE] = &&op_OP_SET_UPVALUE,
+    [OP_GET_ENCLOSING] = &&op_OP_GET_ENCLOSING,
+    [OP_SET_ENCLOSING] = &&op_OP_SET_ENCLOSING,
+    [OP_GET_PROPERTY] = &&op_OP_GET_PROPERTY,
+    [OP_SET_PROPERTY] = &&op_OP_SET_PROPERTY,
+    [OP_GET_SUPER] = &&op_OP_GET_SUPER,
+    [OP_EQUAL] = &&op_OP_EQUAL,
+    [OP_GREATER] = &&op_OP_GREATER,
+    [OP_LESS] = &&op_OP_LESS,
+    [OP_ADD] = &&op_OP_ADD,
+    [OP_SUBTRACT] = &&op_OP_SUBTRACT,
+    [OP_MULTIPLY] = &&op_OP_MULTIPLY,
+    [OP_DIVIDE] = &&op_OP_DIVIDE,
+    [OP_NOT] = &&op_OP_NOT,
+    [OP_NEGATE] = &&op_OP_NEGATE,
+    [OP_PRINT] = &&op_OP_PRINT,
+    [OP_JUMP] = &&op_OP_JUMP,
+    [OP_JUMP_IF_FALSE] = &&op_OP_JUMP_IF_FALSE,
+    [OP_LOOP] = &&op_OP_LOOP,
+    [OP_CALL] = &&op_OP_CALL,
+    [OP_INVOKE] = &&op_OP_INVOKE,
+    [OP_SUPER_INVOKE] = &&op_OP_SUPER_INVOKE,
+    [OP_CLOSURE] = &&op_OP_CLOSURE,
+    [OP_CLOSE_UPVALUE] = &&op_OP_CLOSE_UPVALUE,
+    [OP_RETURN] = &&op_OP_RETURN,
+    [OP_CLASS] = &&op_OP_CLASS,
+    [OP_INHERIT] = &&op_OP_INHERIT,
+    [OP_METHOD] = &&op_OP_METHOD
+  };
+
+#define DISPATCH() \
+    do { \
+      RUN_COMPILED(); \
+      TRACE_EXECUTION(); \
+      goto *dispatchTable[READ_BYTE()]; \
+    } while (false)
+#define CASE(opcode) op_##opcode:
+
+  DISPATCH();
+  {
+#else
+#define DISPATCH() break
+#define CASE(opcode) case opcode:
+
+  for (;;) {
+    RUN_COMPILED();
+    TRACE_EXECUTION();
+    switch (READ_BYTE()) {
+#endif
+      CASE(OP_CONSTANT) {
         Value constant = READ_CONSTANT();
         push(constant);
-        break;
+        DISPATCH();
       }
-      case OP_NIL: push(NIL_VAL); break;
-      case OP_TRUE: push(BOOL_VAL(true)); break;
-      case OP_FALSE: push(BOOL_VAL(false)); break;
-      case OP_POP: pop(); break;
-      case OP_GET_LOCAL: {
+      CASE(OP_NIL) push(NIL_VAL); DISPATCH();
+      CASE(OP_TRUE) push(BOOL_VAL(true)); DISPATCH();
+      CASE(OP_FALSE) push(BOOL_VAL(false)); DISPATCH();
+      CASE(OP_POP) pop(); DISPATCH();
+      CASE(OP_GET_LOCAL) {
         uint8_t slot = READ_BYTE();
         push(frame->slots[slot]);
-        break;
+        DISPATCH();
       }
-      case OP_SET_LOCAL: {
+      CASE(OP_SET_LOCAL) {
         uint8_t slot = READ_BYTE();
         frame->slots[slot] = peek(0);
-        break;
+        DISPATCH();
       }
-      case OP_GET_GLOBAL: {
+      CASE(OP_GET_GLOBAL) {
         ObjString* name = READ_STRING();
         Value value;
         if (!tableGet(&vm.globals, name, &value)) {
-          runtimeError("Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
         }
         push(value);
-        break;
+        DISPATCH();
       }
-      case OP_DEFINE_GLOBAL: {
+      CASE(OP_DEFINE_GLOBAL) {
         ObjString* name = READ_STRING();
+        SAVE_IP();
         tableSet(&vm.globals, name, peek(0));
         pop();
-        break;
+        DISPATCH();
       }
-      case OP_SET_GLOBAL: {
+      CASE(OP_SET_GLOBAL) {
         ObjString* name = READ_STRING();
+        SAVE_IP();
         if (tableSet(&vm.globals, name, peek(0))) {
           tableDelete(&vm.globals, name); // [delete]
-          runtimeError("Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
         }
-        break;
+        DISPATCH();
       }
-      case OP_BUILD_LIST: {
+      CASE(OP_BUILD_LIST) {
         // Stack before: [item1, item2, ..., itemN] and after: [list]
-        ObjList* list = newList();
         uint8_t itemCount = READ_BYTE();
+        SAVE_IP();
+        ObjList* list = newList();
 
         // Add items to list
         push(OBJ_VAL(list)); // So list isn't sweeped by GC in appendToList
@@ -526,76 +1219,83 @@ static InterpretResult run() {
         }
 
         push(OBJ_VAL(list));
-        break;
+        DISPATCH();
       }
-      case OP_INDEX_SUBSCR: {
+      CASE(OP_INDEX_SUBSCR) {
         // Stack before: [list, index] and after: [index(list, index)]
         Value index = pop();
         Value list = pop();
         Value result;
 
         if (!IS_LIST(list)) {
-          runtimeError("Invalid type to index into.");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("Invalid type to index into.");
         }
         ObjList* list_obj = AS_LIST(list);
 
         if (!IS_NUMBER(index)) {
-          runtimeError("List index is not a number.");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("List index is not a number.");
         }
         int index_obj = AS_NUMBER(index);
 
         if (!isValidListIndex(list_obj, index_obj)) {
-          runtimeError("List index out of range.");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("List index out of range.");
         }
 
         result = indexFromList(list_obj, index_obj);
         push(result);
-        break;
+        DISPATCH();
       }
-      case OP_STORE_SUBSCR: {
+      CASE(OP_STORE_SUBSCR) {
         // Stack before: [list, index, item] and after: [item]
         Value item = pop();
         Value index = pop();
         Value list = pop();
 
         if (!IS_LIST(list)) {
-          runtimeError("Cannot store value in a non-list.");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("Cannot store value in a non-list.");
         }
         ObjList* list_obj = AS_LIST(list);
 
         if (!IS_NUMBER(index)) {
-          runtimeError("List index is not a number.");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("List index is not a number.");
         }
         int index_obj = AS_NUMBER(index);
 
         if (!isValidListIndex(list_obj, index_obj)) {
-          runtimeError("Invalid list index.");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("Invalid list index.");
         }
 
         storeToList(list_obj, index_obj, item);
         push(item);
-        break;
+        DISPATCH();
       }
-      case OP_GET_UPVALUE: {
+      CASE(OP_GET_UPVALUE) {
         uint8_t slot = READ_BYTE();
         push(*frame->closure->upvalues[slot]->location);
-        break;
+        DISPATCH();
       }
-      case OP_SET_UPVALUE: {
+      CASE(OP_SET_UPVALUE) {
         uint8_t slot = READ_BYTE();
-        *frame->closure->upvalues[slot]->location = peek(0);
-        break;
+        ObjUpvalue* upvalue = frame->closure->upvalues[slot];
+        *upvalue->location = peek(0);
+        WRITE_BARRIER(upvalue, peek(0));
+        DISPATCH();
       }
-      case OP_GET_PROPERTY: {
+      CASE(OP_GET_ENCLOSING) {
+        // Only emitted for functions called directly from the frame
+        // that declared them, which is therefore the caller's frame.
+        uint8_t slot = READ_BYTE();
+        push(frame[-1].slots[slot]);
+        DISPATCH();
+      }
+      CASE(OP_SET_ENCLOSING) {
+        uint8_t slot = READ_BYTE();
+        frame[-1].slots[slot] = peek(0);
+        DISPATCH();
+      }
+      CASE(OP_GET_PROPERTY) {
         if (!IS_INSTANCE(peek(0))) {
-          runtimeError("Only instances have properties.");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("Only instances have properties.");
         }
 
         ObjInstance* instance = AS_INSTANCE(peek(0));
@@ -605,127 +1305,154 @@ static InterpretResult run() {
         if (tableGet(&instance->fields, name, &value)) {
           pop(); // Instance.
           push(value);
-          break;
+          DISPATCH();
         }
 
+        SAVE_IP();
         if (!bindMethod(instance->klass, name)) {
           return INTERPRET_RUNTIME_ERROR;
         }
-        break;
+        DISPATCH();
       }
-      case OP_SET_PROPERTY: {
+      CASE(OP_SET_PROPERTY) {
         if (!IS_INSTANCE(peek(1))) {
-          runtimeError("Only instances have fields.");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("Only instances have fields.");
         }
 
         ObjInstance* instance = AS_INSTANCE(peek(1));
-        tableSet(&instance->fields, READ_STRING(), peek(0));
+        ObjString* name = READ_STRING();
+        SAVE_IP();
+        tableSet(&instance->fields, name, peek(0));
+        WRITE_BARRIER(instance, OBJ_VAL(name));
+        WRITE_BARRIER(instance, peek(0));
         Value value = pop();
         pop();
         push(value);
-        break;
+        DISPATCH();
       }
-      case OP_GET_SUPER: {
+      CASE(OP_GET_SUPER) {
         ObjString* name = READ_STRING();
         ObjClass* superclass = AS_CLASS(pop());
         
+        SAVE_IP();
         if (!bindMethod(superclass, name)) {
           return INTERPRET_RUNTIME_ERROR;
         }
-        break;
+        DISPATCH();
       }
-      case OP_EQUAL: {
+      CASE(OP_EQUAL) {
         Value b = pop();
         Value a = pop();
         push(BOOL_VAL(valuesEqual(a, b)));
-        break;
+        DISPATCH();
       }
-      case OP_GREATER:  BINARY_OP(BOOL_VAL, >); break;
-      case OP_LESS:     BINARY_OP(BOOL_VAL, <); break;
-      case OP_ADD: {
+      CASE(OP_GREATER)  BINARY_OP(BOOL_VAL, >); DISPATCH();
+      CASE(OP_LESS)     BINARY_OP(BOOL_VAL, <); DISPATCH();
+      CASE(OP_ADD) {
         if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+          SAVE_IP();
           concatenate();
         } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
           double b = AS_NUMBER(pop());
           double a = AS_NUMBER(pop());
           push(NUMBER_VAL(a + b));
         } else if (IS_LIST(peek(0)) && IS_LIST(peek(1))) {
-          ObjList* b = AS_LIST(pop());
-          ObjList* a = AS_LIST(pop());
+          // Both lists stay on the stack while a grows.
+          SAVE_IP();
+          ObjList* b = AS_LIST(peek(0));
+          ObjList* a = AS_LIST(peek(1));
           for (int i = 0; i != b->count; ++i) {
             appendToList(a, b->items[i]);
           }
-          push(OBJ_VAL(a));
+          pop();
         } else {
-          runtimeError(
+          RUNTIME_ERROR(
               "Operands must be two numbers two lists or two strings.");
-          return INTERPRET_RUNTIME_ERROR;
         }
-        break;
+        DISPATCH();
       }
-      case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-      case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-      case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /); break;
-      case OP_NOT:
+      CASE(OP_SUBTRACT) BINARY_OP(NUMBER_VAL, -); DISPATCH();
+      CASE(OP_MULTIPLY) BINARY_OP(NUMBER_VAL, *); DISPATCH();
+      CASE(OP_DIVIDE)   BINARY_OP(NUMBER_VAL, /); DISPATCH();
+      CASE(OP_NOT)
         push(BOOL_VAL(isFalsey(pop())));
-        break;
-      case OP_NEGATE:
+        DISPATCH();
+      CASE(OP_NEGATE)
         if (!IS_NUMBER(peek(0))) {
-          runtimeError("Operand must be a number.");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("Operand must be a number.");
         }
         push(NUMBER_VAL(-AS_NUMBER(pop())));
-        break;
-      case OP_PRINT: {
+        DISPATCH();
+      CASE(OP_PRINT) {
         printValue(pop());
         printf("\n");
-        break;
+        DISPATCH();
       }
-      case OP_JUMP: {
+      CASE(OP_JUMP) {
         uint16_t offset = READ_SHORT();
-        frame->ip += offset;
-        break;
+        ip += offset;
+        DISPATCH();
       }
-      case OP_JUMP_IF_FALSE: {
+      CASE(OP_JUMP_IF_FALSE) {
         uint16_t offset = READ_SHORT();
-        if (isFalsey(peek(0))) frame->ip += offset;
-        break;
+        if (isFalsey(peek(0))) ip += offset;
+        DISPATCH();
       }
-      case OP_LOOP: {
+      CASE(OP_LOOP) {
         uint16_t offset = READ_SHORT();
-        frame->ip -= offset;
-        break;
+        ip -= offset;
+#ifdef CLOX_JIT
+        warmUp(frame->closure->function);
+        LOAD_COMPILED();
+#endif
+        DISPATCH();
       }
-      case OP_CALL: {
+      CASE(OP_CALL) {
         int argCount = READ_BYTE();
+        SAVE_IP();
         if (!callValue(peek(argCount), argCount)) {
           return INTERPRET_RUNTIME_ERROR;
         }
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
+        LOAD_FRAME();
+        DISPATCH();
       }
-      case OP_INVOKE: {
+      CASE(OP_INVOKE) {
         ObjString* method = READ_STRING();
         int argCount = READ_BYTE();
+        SAVE_IP();
         if (!invoke(method, argCount)) {
           return INTERPRET_RUNTIME_ERROR;
         }
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
+        LOAD_FRAME();
+        DISPATCH();
       }
-      case OP_SUPER_INVOKE: {
+      CASE(OP_SUPER_INVOKE) {
         ObjString* method = READ_STRING();
         int argCount = READ_BYTE();
         ObjClass* superclass = AS_CLASS(pop());
+        SAVE_IP();
         if (!invokeFromClass(superclass, method, argCount)) {
           return INTERPRET_RUNTIME_ERROR;
         }
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
+        LOAD_FRAME();
+        DISPATCH();
       }
-      case OP_CLOSURE: {
+      CASE(OP_CLOSURE) {
         ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+        SAVE_IP();
+        if (function->upvalueCount == 0 ||
+            function->usesEnclosingFrame) {
+          // Nothing is captured, so every evaluation of the declaration
+          // can produce the same closure.
+          if (function->sharedClosure == NULL) {
+            function->sharedClosure = newClosure(function);
+            WRITE_BARRIER(function, OBJ_VAL(function->sharedClosure));
+          }
+          ip += 2 * function->upvalueCount;
+          push(OBJ_VAL(function->sharedClosure));
+          DISPATCH();
+        }
+
         ObjClosure* closure = newClosure(function);
         push(OBJ_VAL(closure));
         for (int i = 0; i < closure->upvalueCount; i++) {
@@ -737,14 +1464,15 @@ static InterpretResult run() {
           } else {
             closure->upvalues[i] = frame->closure->upvalues[index];
           }
+          WRITE_BARRIER(closure, OBJ_VAL(closure->upvalues[i]));
         }
-        break;
+        DISPATCH();
       }
-      case OP_CLOSE_UPVALUE:
+      CASE(OP_CLOSE_UPVALUE)
         closeUpvalues(vm.stackTop - 1);
         pop();
-        break;
-      case OP_RETURN: {
+        DISPATCH();
+      CASE(OP_RETURN) {
         Value result = pop();
         closeUpvalues(frame->slots);
         vm.frameCount--;
@@ -755,41 +1483,55 @@ static InterpretResult run() {
 
         vm.stackTop = frame->slots;
         push(result);
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
+        LOAD_FRAME();
+        DISPATCH();
+      }
+      CASE(OP_CLASS) {
+        ObjString* name = READ_STRING();
+        SAVE_IP();
+        push(OBJ_VAL(newClass(name)));
+        DISPATCH();
       }
-      case OP_CLASS:
-        push(OBJ_VAL(newClass(READ_STRING())));
-        break;
-      case OP_INHERIT: {
+      CASE(OP_INHERIT) {
         Value superclass = peek(1);
         if (!IS_CLASS(superclass)) {
-          runtimeError("Superclass must be a class.");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("Superclass must be a class.");
         }
 
         ObjClass* subclass = AS_CLASS(peek(0));
-        tableAddAll(&AS_CLASS(superclass)->methods,
-                    &subclass->methods);
+        SAVE_IP();
+        inheritMethods(AS_CLASS(superclass), subclass);
         pop(); // Subclass.
-        break;
+        DISPATCH();
       }
-      case OP_METHOD:
-        defineMethod(READ_STRING());
-        break;
+      CASE(OP_METHOD) {
+        ObjString* name = READ_STRING();
+        SAVE_IP();
+        defineMethod(name);
+        DISPATCH();
+      }
+#ifndef COMPUTED_GOTO
     }
+#endif
   }
 
+  return INTERPRET_RUNTIME_ERROR; // Unreachable.
+
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef SAVE_IP
+#undef LOAD_COMPILED
+#undef RUN_COMPILED
+#undef LOAD_FRAME
+#undef RUNTIME_ERROR
 #undef BINARY_OP
+#undef TRACE_EXECUTION
+#undef DISPATCH
+#undef CASE
 }
-InterpretResult interpret(const char* source) {
-  ObjFunction* function = compile(source);
-  if (function == NULL) return INTERPRET_COMPILE_ERROR;
-
+static InterpretResult runScript(ObjFunction* function) {
   push(OBJ_VAL(function));
   ObjClosure* closure = newClosure(function);
   pop();
@@ -798,3 +1540,96 @@ InterpretResult interpret(const char* source) {
 
   return run();
 }
+// Source is either a whole string or read through reader.
+typedef struct {
+  const char* source;
+  SourceReader reader;
+  void* context;
+  const char* name;
+} SourceInput;
+
+static ObjFunction* compileInput(const SourceInput* input) {
+  if (input->reader != NULL) {
+    return compileStream(input->reader, input->context);
+  }
+  return compile(input->source);
+}
+static InterpretResult interpretSource(const void* input) {
+  ObjFunction* function = compileInput((const SourceInput*)input);
+  if (function == NULL) return INTERPRET_COMPILE_ERROR;
+
+  return runScript(function);
+}
+static InterpretResult runImage(ObjFunction* function) {
+  if (function == NULL) {
+    runtimeError("Bad or outdated bytecode image.");
+    return INTERPRET_COMPILE_ERROR;
+  }
+
+  return runScript(function);
+}
+static InterpretResult interpretLoadedImage(const void* image) {
+  return runImage(loadImage((const uint8_t*)image));
+}
+// Runs body, returning to here if memory runs out. Everything the VM
+// was doing is abandoned, leaving it ready to run another script.
+static InterpretResult protect(InterpretResult (*body)(const void*),
+                               const void* input) {
+  jmp_buf outOfMemory;
+  jmp_buf* enclosing = vm.outOfMemory;
+  InterpretResult result;
+
+  vm.outOfMemory = &outOfMemory;
+  if (setjmp(outOfMemory) == 0) {
+    result = body(input);
+  } else {
+    abandonCompile();
+    resetStack();
+    result = INTERPRET_RUNTIME_ERROR;
+  }
+  vm.outOfMemory = enclosing;
+  return result;
+}
+InterpretResult interpret(const char* source) {
+  SourceInput input = {source, NULL, NULL, NULL};
+  return protect(interpretSource, &input);
+}
+InterpretResult interpretStream(SourceReader reader, void* context) {
+  SourceInput input = {NULL, reader, context, NULL};
+  return protect(interpretSource, &input);
+}
+InterpretResult interpretImage(const uint8_t* image) {
+  return protect(interpretLoadedImage, image);
+}
+#ifdef CLOX_COMPILED_CODE
+typedef struct {
+  const uint8_t* image;
+  const CompiledCode* compiled;
+} CompiledImage;
+
+static InterpretResult interpretLoadedCompiledImage(const void* input) {
+  const CompiledImage* image = (const CompiledImage*)input;
+  return runImage(loadCompiledImage(image->image, image->compiled));
+}
+InterpretResult interpretCompiledImage(const uint8_t* image,
+                                       const CompiledCode* compiled) {
+  CompiledImage input = {image, compiled};
+  return protect(interpretLoadedCompiledImage, &input);
+}
+#endif
+static InterpretResult dumpSource(const void* input) {
+  ObjFunction* function = compileInput((const SourceInput*)input);
+  if (function == NULL) return INTERPRET_COMPILE_ERROR;
+
+  dumpImage(function, ((const SourceInput*)input)->name);
+  return INTERPRET_OK;
+}
+InterpretResult compileImage(const char* source, const char* name) {
+  SourceInput input = {source, NULL, NULL, name};
+  return protect(dumpSource, &input);
+}
+InterpretResult compileImageStream(SourceReader reader, void* context,
+                                   const char* name) {
+  SourceInput input = {NULL, reader, context, name};
+  return protect(dumpSource, &input);
+}
\ No newline at end of file
@@ -1,19 +1,45 @@
 #ifndef clox_vm_h
 #define clox_vm_h
 
+#include <setjmp.h>
+
 #include "object.h"
+#include "scanner.h"
 #include "table.h"
 #include "value.h"
 
 #define FRAMES_MAX 64
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
 
-typedef struct {
+typedef struct CallFrame {
   ObjClosure* closure;
   uint8_t* ip;
   Value* slots;
 } CallFrame;
 
+typedef enum {
+  GC_IDLE,
+  GC_MARK,
+  GC_SWEEP
+} GcPhase;
+
+// Bucket i counts pauses shorter than gcPauseLimits[i] microseconds,
+// the last bucket all longer ones.
+#define GC_PAUSE_BUCKETS 10
+
+typedef struct {
+  unsigned long count;
+  unsigned long total;
+  unsigned long longest;
+  unsigned long histogram[GC_PAUSE_BUCKETS];
+} GcPauses;
+
+typedef struct {
+  unsigned long minorCollections;
+  unsigned long majorCollections;
+  unsigned long objectCounts[OBJ_TYPE_COUNT];
+} GcStats;
+
 typedef struct {
   CallFrame frames[FRAMES_MAX];
   int frameCount;
@@ -24,13 +50,37 @@ typedef struct {
   Table strings;
   ObjString* initString;
   ObjUpvalue* openUpvalues;
+  // Whether the compiler calls pure natives with constant arguments.
+  // Tools compiling on a desktop for the board turn this off, as the
+  // board's natives can give different results from theirs.
+  bool foldPureCalls;
 
   size_t bytesAllocated;
+  // Zero if the heap may grow for as long as there is memory.
+  size_t heapLimit;
+  // Room past heapLimit after running out, until a major collection
+  // finds the heap back under the limit.
+  size_t heapReserve;
+  jmp_buf* outOfMemory;
   size_t nextGC;
+  size_t nextMajorGC;
+  size_t gcNurserySize;
+  double gcGrowFactor;
+  GcPhase gcPhase;
+  bool markEpoch;
+  unsigned long gcStepMicros;
+  GcPauses gcPauses;
+  GcStats gcStats;
   Obj* objects;
+  Obj* oldObjects;
+  Obj* unsweptYoung;
+  Obj* unsweptOld;
   int grayCount;
   int grayCapacity;
   Obj** grayStack;
+  int rememberedCount;
+  int rememberedCapacity;
+  Obj** rememberedSet;
 } VM;
 
 typedef enum {
@@ -44,6 +94,15 @@ extern VM vm;
 void initVM();
 void freeVM();
 InterpretResult interpret(const char* source);
+InterpretResult interpretStream(SourceReader reader, void* context);
+InterpretResult interpretImage(const uint8_t* image);
+#ifdef CLOX_COMPILED_CODE
+InterpretResult interpretCompiledImage(const uint8_t* image,
+                                       const CompiledCode* compiled);
+#endif
+InterpretResult compileImage(const char* source, const char* name);
+InterpretResult compileImageStream(SourceReader reader, void* context,
+                                   const char* name);
 void push(Value value);
 Value pop();
 void runtimeError(const char* format, ...);